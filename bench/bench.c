@@ -0,0 +1,370 @@
+/* bench - measure passh against a fake ssh (`make bench')
+
+   Usage: bench [-m MB] [-n runs] PASSH FAKESSH
+
+   For every scenario passh runs FAKESSH which asks for a password and then
+   writes MB megabytes. Reported (best of the runs):
+
+     MB/s        relay throughput, from starting passh till it exits
+     CPU ms/MB   CPU time of passh itself (not of the fake ssh)
+     calls/MB    syscalls made by passh, if strace(1) is installed
+     prompt us   from the prompt being written till the password is read
+     exec us     from starting passh till the fake ssh is running
+
+   The startup scenarios run a fake ssh which writes nothing, many times,
+   and report the median exec us for each way passh can start its child.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_ARGS   32
+#define FLEET_SIZE 8
+#define STARTUPS   50
+
+struct result {
+    double wall;                /* seconds */
+    double cpu;                 /* seconds, passh only */
+    long long calls;            /* -1 if unknown */
+    long long prompt_us;
+    long long exec_us;
+    long long nread;
+};
+
+static char *passh;
+static char *fakessh;
+static char tmpdir[] = "/tmp/passh-bench.XXXXXX";
+static int mb = 64;
+static int runs = 3;
+static bool have_strace;
+
+int64_t
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+double
+tv2sec(struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/*
+ * Add up what the fake ssh's reported (there's one report per host in
+ * fleet mode). Returns its CPU time.
+ */
+double
+read_reports(struct result *res, int nhosts)
+{
+    char path[256], line[256];
+    double cpu = 0;
+    long long v;
+    FILE *fp;
+    int i;
+
+    res->prompt_us = res->exec_us = 0;
+    for (i = 0; i < nhosts; ++i) {
+        snprintf(path, sizeof(path), "%s/h%d.rep", tmpdir, i);
+        if ((fp = fopen(path, "r")) == NULL) {
+            continue;
+        }
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (sscanf(line, "prompt_us=%lld", &v) == 1 && v > res->prompt_us) {
+                res->prompt_us = v;
+            } else if (sscanf(line, "exec_us=%lld", &v) == 1 && v > res->exec_us) {
+                res->exec_us = v;
+            } else if (sscanf(line, "user_us=%lld", &v) == 1
+                       || sscanf(line, "sys_us=%lld", &v) == 1) {
+                cpu += v / 1e6;
+            }
+        }
+        fclose(fp);
+        unlink(path);
+    }
+    return cpu;
+}
+
+/*
+ * The total line of `strace -c': "100.00 <seconds> <usecs/call> <calls> ..."
+ */
+long long
+read_strace(char *path)
+{
+    char line[256];
+    long long calls = -1;
+    double pct, secs;
+    long usecs;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strstr(line, " total") != NULL
+            && sscanf(line, "%lf %lf %ld %lld", &pct, &secs, &usecs, &calls) != 4) {
+            calls = -1;
+        }
+    }
+    fclose(fp);
+    unlink(path);
+    return calls;
+}
+
+/*
+ * Run passh once with `args' and fill in `res'. Returns false on failure.
+ */
+bool
+run(char **args, int nhosts, bool strace, struct result *res)
+{
+    char *argv[MAX_ARGS + 4], buf[64 * 1024], t0[32], trace[256];
+    struct rusage ru0, ru;
+    int64_t start;
+    int fds[2], status, i, n = 0;
+    ssize_t nread;
+    pid_t pid;
+
+    snprintf(trace, sizeof(trace), "%s/strace.out", tmpdir);
+    if (strace) {
+        argv[n++] = "strace";
+        argv[n++] = "-c";
+        argv[n++] = "-o";
+        argv[n++] = trace;
+    }
+    for (i = 0; args[i] != NULL; ++i) {
+        argv[n++] = args[i];
+    }
+    argv[n] = NULL;
+
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    getrusage(RUSAGE_CHILDREN, &ru0);
+    start = now_us();
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        exit(1);
+    } else if (pid == 0) {
+        snprintf(t0, sizeof(t0), "%lld", (long long) now_us());
+        setenv("BENCH_T0", t0, 1);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        close(STDIN_FILENO);
+        open("/dev/null", O_RDONLY);
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    res->nread = 0;
+    while ((nread = read(fds[0], buf, sizeof(buf))) != 0) {
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        } else if (nread < 0) {
+            break;
+        }
+        res->nread += nread;
+    }
+    close(fds[0]);
+
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        exit(1);
+    }
+    res->wall = (now_us() - start) / 1e6;
+
+    /* passh's own usage plus that of the children it reaped */
+    getrusage(RUSAGE_CHILDREN, &ru);
+    res->cpu = tv2sec(&ru.ru_utime) + tv2sec(&ru.ru_stime)
+        - tv2sec(&ru0.ru_utime) - tv2sec(&ru0.ru_stime);
+    res->cpu -= read_reports(res, nhosts);
+    res->calls = strace ? read_strace(trace) : -1;
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void
+scenario(char *name, char **opts, bool fleet)
+{
+    char *args[MAX_ARGS], hosts[256], rep[256], mbs[16];
+    struct result res, best = { 0 };
+    int i, n = 0, nhosts = fleet ? FLEET_SIZE : 1;
+    FILE *fp;
+
+    args[n++] = passh;
+    args[n++] = "-p";
+    args[n++] = "secret";
+    for (i = 0; opts[i] != NULL; ++i) {
+        args[n++] = opts[i];
+    }
+    if (fleet) {
+        snprintf(hosts, sizeof(hosts), "%s/hosts", tmpdir);
+        if ((fp = fopen(hosts, "w")) == NULL) {
+            perror(hosts);
+            exit(1);
+        }
+        for (i = 0; i < nhosts; ++i) {
+            fprintf(fp, "h%d\n", i);
+        }
+        fclose(fp);
+        args[n++] = "-F";
+        args[n++] = hosts;
+        snprintf(rep, sizeof(rep), "%s/{}.rep", tmpdir);
+    } else {
+        snprintf(rep, sizeof(rep), "%s/h0.rep", tmpdir);
+    }
+    snprintf(mbs, sizeof(mbs), "%d", fleet ? mb / nhosts : mb);
+    args[n++] = fakessh;
+    args[n++] = "-m";
+    args[n++] = mbs;
+    args[n++] = "-r";
+    args[n++] = rep;
+    args[n] = NULL;
+
+    for (i = 0; i < runs; ++i) {
+        if (! run(args, nhosts, false, &res)) {
+            printf("%-24s failed\n", name);
+            return;
+        }
+        if (i == 0 || res.wall < best.wall) {
+            best = res;
+        }
+    }
+    if (have_strace) {
+        run(args, nhosts, true, &res);
+        best.calls = res.calls;
+    }
+
+    printf("%-24s %8.1f %10.2f ", name, mb / best.wall, best.cpu * 1000 / mb);
+    if (best.calls >= 0) {
+        printf("%9.0f ", (double) best.calls / mb);
+    } else {
+        printf("%9s ", "n/a");
+    }
+    printf("%10lld %9lld\n", best.prompt_us, best.exec_us);
+}
+
+int
+ll_cmp(const void *a, const void *b)
+{
+    long long x = *(const long long *) a, y = *(const long long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+void
+startup(char *name, char **opts)
+{
+    char *args[MAX_ARGS], rep[256];
+    long long exec_us[STARTUPS];
+    struct result res;
+    int i, n = 0;
+
+    args[n++] = passh;
+    args[n++] = "-p";
+    args[n++] = "secret";
+    for (i = 0; opts[i] != NULL; ++i) {
+        args[n++] = opts[i];
+    }
+    snprintf(rep, sizeof(rep), "%s/h0.rep", tmpdir);
+    args[n++] = fakessh;
+    args[n++] = "-b";
+    args[n++] = "0";
+    args[n++] = "-m";
+    args[n++] = "0";
+    args[n++] = "-r";
+    args[n++] = rep;
+    args[n] = NULL;
+
+    for (i = 0; i < STARTUPS; ++i) {
+        if (! run(args, 1, false, &res)) {
+            printf("%-24s failed\n", name);
+            return;
+        }
+        exec_us[i] = res.exec_us;
+    }
+    qsort(exec_us, STARTUPS, sizeof(long long), ll_cmp);
+
+    printf("%-24s %8s %10s %9s %10s %9lld\n", name, "-", "-", "-", "-",
+           exec_us[STARTUPS / 2]);
+}
+
+void
+usage(void)
+{
+    fprintf(stderr, "Usage: bench [-m MB] [-n runs] PASSH FAKESSH\n");
+    exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char log[256], rec[256], hosts[256];
+    int ch;
+
+    while ((ch = getopt(argc, argv, "m:n:")) != -1) {
+        switch (ch) {
+            case 'm':
+                mb = atoi(optarg);
+                break;
+            case 'n':
+                runs = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (argc - optind != 2 || mb < FLEET_SIZE || runs < 1) {
+        usage();
+    }
+    passh = argv[optind];
+    fakessh = argv[optind + 1];
+
+    if (mkdtemp(tmpdir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(log, sizeof(log), "%s/L.log", tmpdir);
+    snprintf(rec, sizeof(rec), "%s/session.rec", tmpdir);
+    have_strace = system("strace -V >/dev/null 2>&1") == 0;
+
+    printf("%d MB, best of %d runs%s\n\n", mb, runs,
+           have_strace ? "" : " (no strace, syscalls not counted)");
+    printf("%-24s %8s %10s %9s %10s %9s\n",
+           "scenario", "MB/s", "CPU ms/MB", "calls/MB", "prompt us", "exec us");
+
+    scenario("prompt matching", (char *[]) { NULL }, false);
+    scenario("pass-through (-c 1)", (char *[]) { "-c", "1", NULL }, false);
+    scenario("logged (-c 1 -L)", (char *[]) { "-c", "1", "-L", log, NULL }, false);
+    scenario("recorded (--record)", (char *[]) { "-c", "1", "--record", rec, NULL }, false);
+    scenario("fleet (-F, 8 hosts)", (char *[]) { NULL }, true);
+    startup("startup (default)", (char *[]) { NULL });
+    startup("startup (--fork)", (char *[]) { "--fork", NULL });
+
+    snprintf(hosts, sizeof(hosts), "%s/hosts", tmpdir);
+    unlink(hosts);
+    unlink(log);
+    unlink(rec);
+    rmdir(tmpdir);
+    return 0;
+}
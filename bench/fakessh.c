@@ -0,0 +1,138 @@
+/* fakessh - a stand-in for ssh used by `make bench'
+
+   Prints some banner lines, asks for a password on /dev/tty like ssh does,
+   then writes N MB to stdout. What it measured is written to the -r file:
+
+     exec_us=<N>     from $BENCH_T0 (set by bench before starting passh)
+                     till this process is running
+     prompt_us=<N>   from writing the prompt till the password is read
+     user_us=<N>     CPU time of this process
+     sys_us=<N>
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define LINESIZE 64
+#define BUFFSIZE (64 * 1024)
+
+int64_t
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void
+usage(void)
+{
+    fprintf(stderr, "Usage: fakessh [-b lines] [-m MB] [-p password] [-r file] [host]\n");
+    exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int64_t t_start = now_us(), t_prompt, exec_us = -1, prompt_us = -1;
+    int banner = 10, mb = 16, ch, fd, i, n;
+    char *password = "secret", *report = NULL, *t0;
+    char line[256], buf[BUFFSIZE];
+    struct termios term, save;
+    struct rusage ru;
+    long long left;
+    FILE *fp;
+
+    while ((ch = getopt(argc, argv, "b:m:p:r:")) != -1) {
+        switch (ch) {
+            case 'b':
+                banner = atoi(optarg);
+                break;
+            case 'm':
+                mb = atoi(optarg);
+                break;
+            case 'p':
+                password = optarg;
+                break;
+            case 'r':
+                report = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if ((t0 = getenv("BENCH_T0")) != NULL) {
+        exec_us = t_start - atoll(t0);
+    }
+
+    for (i = 0; i < banner; ++i) {
+        printf("Banner line %d of the fake server, nothing to see here\n", i + 1);
+    }
+    fflush(stdout);
+
+    /* like ssh: prompt and read on /dev/tty with echo off */
+    if ((fd = open("/dev/tty", O_RDWR)) < 0) {
+        perror("fakessh: /dev/tty");
+        return 1;
+    }
+    tcgetattr(fd, &save);
+    term = save;
+    term.c_lflag &= ~(ECHO | ECHONL);
+    tcsetattr(fd, TCSAFLUSH, &term);
+
+    t_prompt = now_us();
+    write(fd, "user@fakehost's password: ", strlen("user@fakehost's password: "));
+    n = 0;
+    while (n < sizeof(line) - 1 && read(fd, line + n, 1) == 1) {
+        if (line[n] == '\n' || line[n] == '\r') {
+            break;
+        }
+        ++n;
+    }
+    line[n] = '\0';
+    prompt_us = now_us() - t_prompt;
+
+    tcsetattr(fd, TCSAFLUSH, &save);
+    write(fd, "\n", 1);
+    close(fd);
+
+    if (strcmp(line, password) != 0) {
+        fprintf(stderr, "Permission denied\n");
+        return 1;
+    }
+
+    /* lines of LINESIZE bytes */
+    for (i = 0; i < BUFFSIZE; ++i) {
+        buf[i] = i % LINESIZE == LINESIZE - 1 ? '\n' : 'a' + i % 26;
+    }
+    for (left = mb * 1024LL * 1024; left > 0; left -= n) {
+        n = left < BUFFSIZE ? left : BUFFSIZE;
+        if ((n = write(STDOUT_FILENO, buf, n)) <= 0) {
+            return 1;
+        }
+    }
+
+    if (report != NULL && (fp = fopen(report, "w")) != NULL) {
+        getrusage(RUSAGE_SELF, &ru);
+        fprintf(fp, "exec_us=%lld\nprompt_us=%lld\nuser_us=%lld\nsys_us=%lld\n",
+                (long long) exec_us, (long long) prompt_us,
+                ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec,
+                ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec);
+        fclose(fp);
+    }
+
+    return 0;
+}
@@ -0,0 +1,104 @@
+/* libpassh - passh as a library
+   Copyright (C) 2017-2020 Clark Wang <dearvoid@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Run many passh sessions in one process, from the caller's own event
+ * loop. It's the same engine as `passh -F' (built from passh.c with
+ * `make libpassh.so'), so:
+ *
+ *  - There is one engine per process and it's not thread-safe: call it
+ *    from one thread only.
+ *  - It takes over SIGCHLD for that thread (see passh_init()) but only
+ *    ever waits for its own children.
+ *  - A failed call returns NULL or -1 and passh_error() says why. After a
+ *    failed passh_init() or passh_step() the engine must not be used any
+ *    more.
+ *
+ * The loop, with poll() for example:
+ *
+ *      passh_init(options, &callbacks);
+ *      s = passh_start("host1", argv, "secret", NULL);
+ *      while (passh_step(0) > 0) {
+ *          pfd.fd = passh_fd();
+ *          pfd.events = POLLIN;
+ *          poll(&pfd, 1, passh_timeout() );
+ *      }
+ */
+
+#ifndef LIBPASSH_H
+#define LIBPASSH_H
+
+#include <stddef.h>
+
+#if defined(PASSH_LIBRARY)
+#define PASSH_API __attribute__((visibility("default") ))
+#else
+#define PASSH_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct passh_session passh_session;
+
+struct passh_callbacks {
+    /* output of the child, as it's read from the pty */
+    void (*output)(passh_session *s, const char *buf, size_t len, void *arg);
+    /* the --events-fd events: `json' is the whole event, without the
+     * newline. `s' is NULL if it's not about a session. */
+    void (*event)(passh_session *s, const char *name, const char *json, void *arg);
+};
+
+/* `options' are passh options (NULL terminated, without COMMAND), e.g.
+ * { "-c", "3", "-C", "-y", NULL }. -F, -s, -l, -L, --events-fd, --reuse,
+ * --control, --record, --replay, --pty-server and --agent are not
+ * supported. */
+PASSH_API int passh_init(char **options, const struct passh_callbacks *cb);
+
+/* Start `argv' on a pty. `label' is the `session' of its events (Default:
+ * argv[0]), `password' overrides -p (NULL if not) and `arg' is passed to
+ * the callbacks. */
+PASSH_API passh_session *passh_start(const char *label, char **argv,
+                                     const char *password, void *arg);
+
+/* An fd to be polled for reading, or -1 if there is none (not on Linux):
+ * then call passh_step() at least every few ms. */
+PASSH_API int passh_fd(void);
+
+/* ms till passh_step() must be called even if passh_fd() is not readable,
+ * -1 if never. */
+PASSH_API int passh_timeout(void);
+
+/* Handle what's due, waiting at most `timeout' ms (-1: as long as it
+ * takes) for something to happen. Returns the number of sessions still
+ * running or to be restarted (--supervise), or -1. */
+PASSH_API int passh_step(int timeout);
+
+/* The exit status, as passh would exit with. -1 while it's running. */
+PASSH_API int passh_exit_code(passh_session *s);
+
+/* Forget a session, killing the child if it's still running. */
+PASSH_API void passh_free(passh_session *s);
+
+PASSH_API const char *passh_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
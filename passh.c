@@ -29,10 +29,18 @@
 #if !defined(__APPLE__) && !defined(__FreeBSD__) && !defined(_AIX)
 #define _XOPEN_SOURCE 600 /* for posix_openpt() */
 #endif
+#if defined(__linux__)
+#define _GNU_SOURCE       /* for splice() */
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <limits.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <stdbool.h>
 #include <string.h>
 #include <fcntl.h>
@@ -41,22 +49,62 @@
 #include <errno.h>
 #include <signal.h>
 #include <regex.h>
+#include <setjmp.h>
 #include <time.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdatomic.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <dirent.h>
+
+#include "libpassh.h"
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#endif
+
+/*
+ * Start the child with posix_spawn() instead of fork(). Only where opening
+ * the pty slave after setsid() makes it the controlling terminal, as there
+ * is no TIOCSCTTY in between.
+ */
+#if defined(__linux__) && defined(POSIX_SPAWN_SETSID)
+#define PTY_SPAWN
+#endif
 
 #define BUFFSIZE         (8 * 1024)
+#define RELAY_BUFFSIZE   (64 * 1024)
+#define RELAY_BUDGET     16  /* reads from a pty before others get a turn */
 #define DEFAULT_COUNT    0
 #define DEFAULT_TIMEOUT  0
+#define EOF_INTERVAL     50  /* ms, doubled after every resend */
+#define EOF_MAX_INTERVAL 800
+#define KILL_DELAY       3000  /* ms from SIGTERM till SIGKILL, see session_fatal() */
+#define OPEN_TIMEOUT     1000  /* ms for the child to open the pty */
+#define DEFAULT_JOBS     32
+#define DEFAULT_HIWAT    (1024 * 1024)
 #define DEFAULT_PASSWD   "password"
 #define DEFAULT_PROMPT   "[Pp]assword: \\{0,1\\}$"
 #define DEFAULT_YESNO    "(yes/no)? \\{0,1\\}$"
+#define DEFAULT_REUSE_IDLE 300
+#define DEFAULT_REUSE_MAX  16
+#define DEFAULT_PTY_POOL 16
+#define DEFAULT_AGENT_TTL 300
+#define DEFAULT_READY_AFTER 1000
+#define DEFAULT_BACKOFF_MIN 500
+#define DEFAULT_BACKOFF_MAX 30000
 
 #define ERROR_GENERAL    (200 + 1)
 #define ERROR_USAGE      (200 + 2)
@@ -64,19 +112,292 @@
 #define ERROR_SYS        (200 + 4)
 #define ERROR_MAX_TRIES  (200 + 5)
 
+#define MAX_RULES        64
+
+#define AGENT_SLOTS      128
+#define AGENT_SECRET_MAX 256
+#define AGENT_KEY_MAX    256
+#define AGENT_FETCH_TIMEOUT 20000  /* ms, a fetch command is killed after */
+#define AGENT_TIMEOUT    30000  /* ms, for an answer from the agent without -t */
+
+#define CTL_REQ_MAX      256
+
+#define PID_BUCKETS      256
+
+#define OUT_STDOUT       0
+#define OUT_TO_PTY       1  /* -l */
+#define OUT_FROM_PTY     2  /* -L */
+#define OUT_EVENTS       3  /* --events-fd */
+#define OUT_RECORD       4  /* --record */
+#define NOUTS            5
+
+#define EVENTS_INTERVAL  1000  /* ms, for the `relayed' events */
+
+#define STATS_BUCKETS    24  /* latencies by the power of 2 of us, till ~8s */
+
+#define POLICY_BLOCK     0
+#define POLICY_DROP      1
+#define POLICY_FAIL      2
+
+/* long only options */
+#define OPT_REUSE        256
+#define OPT_REUSE_IDLE   257
+#define OPT_REUSE_MAX    258
+#define OPT_PTY_SERVER   259
+#define OPT_PTY_POOL     260
+#define OPT_PTY_POOL_SIZE 261
+#define OPT_FORK         262
+#define OPT_AGENT        263
+#define OPT_AGENT_FETCH  264
+#define OPT_AGENT_TTL    265
+#define OPT_AGENT_KEY    266
+#define OPT_EVENTS_FD    267
+#define OPT_READY        268
+#define OPT_READY_PATTERN 269
+#define OPT_READY_AFTER  270
+#define OPT_SUPERVISE    271
+#define OPT_SUPERVISE_MAX 272
+#define OPT_BACKOFF      273
+#define OPT_STATS        274
+#define OPT_STATS_FILE   275
+#define OPT_CONTROL      276
+#define OPT_TAIL         277
+#define OPT_TAIL_FILE    278
+#define OPT_TAIL_INPUT   279
+#define OPT_RECORD       280
+#define OPT_REPLAY       281
+#define OPT_ASCIICAST    282
+
+/* --record, see rec_put() */
+#define REC_MAGIC        "passhrec"
+#define REC_HDRSIZE      16
+#define REC_START        's'
+#define REC_OUTPUT       'o'
+#define REC_INPUT        'i'  /* from stdin */
+#define REC_SENT         'p'  /* by passh itself: answers and EOF */
+#define REC_EXIT         'x'
+
+#define SESS_PENDING     0
+#define SESS_RUNNING     1
+#define SESS_DONE        2
+
 char * const MY_NAME  = "passh";
 char * const VERSION_ = "1.0.2";
 
+/*
+ * A prompt to answer. The `(yes/no)?' and the password prompts are rules too.
+ */
+struct rule {
+    char *pattern;
+    char *response;             /* with the trailing CR. NULL: the password */
+    int max;                    /* answer at most <max> times (0: no limit) */
+    bool fatal_more;            /* exit if prompted for the <max+1>th time */
+    bool icase;
+    bool fallback;              /* not supported by the matcher, use regexec() */
+    bool ready;                 /* --ready-pattern, nothing to send */
+    regex_t re;
+};
+
+/* the DFA state of one output stream, see matcher_feed() */
+struct mstate {
+    int state;
+    unsigned epoch;
+    int *nfa;                   /* of `state', saved by dfa_reset() */
+    int n;
+};
+
+/*
+ * Ring buffer between the event loop (the only producer) and the log
+ * thread (the only consumer). See log_put().
+ */
+struct logring {
+    char *buf;
+    size_t size;                /* power of 2 */
+    atomic_size_t head;         /* advanced by the log thread */
+    atomic_size_t tail;         /* advanced by the event loop */
+    atomic_int err;             /* errno of a failed write */
+    atomic_ullong logged;
+    unsigned long long dropped;
+};
+
+/*
+ * See timer_set().
+ */
+struct timer {
+    int64_t when;               /* CLOCK_MONOTONIC, in ms */
+    int index;                  /* in the heap, -1 if not armed */
+    void (*fn)(struct timer *);
+    void *arg;
+};
+
+/*
+ * Output queue of stdout or a log. See out_write().
+ */
+struct outq {
+    const char *name;
+    int fd;
+    bool async;                 /* non-blocking, flushed by the event loop */
+    bool log;                   /* written by the log thread */
+    struct logring ring;
+    int orig_flags;             /* to restore at exit, -1 if not changed */
+    bool watched;
+    bool stalled;               /* splice() found it full */
+    bool lossy;                 /* drop rather than block or fail */
+    bool paused;                /* `log off' of --control */
+    unsigned long long writes;  /* --stats */
+    unsigned long long nwritten;
+    char *buf;
+    size_t off;
+    size_t len;
+    size_t size;
+};
+
+/*
+ * --stats of a session, over all its runs (--supervise). Counted always,
+ * timed only with --stats. Times are in ns unless noted.
+ */
+struct stats {
+    unsigned long long nread;       /* of the runs before this one */
+    unsigned long long reads;       /* read() and splice() on the pty */
+    unsigned long long nwritten;
+    unsigned long long writes;
+    unsigned long long matches;     /* matcher_feed() calls */
+    unsigned long long regexecs;    /* of the fallback rules */
+    int64_t match_time;
+    int64_t regexec_time;
+    int64_t spawned;
+    int64_t first_output;           /* 0 till there is some */
+    int64_t read_at;                /* of the last output, for the latency */
+    unsigned long long latency[STATS_BUCKETS];  /* prompt read -> password sent */
+    unsigned long long nlatency;
+    int64_t latency_sum;
+    int64_t latency_max;
+    struct timeval utime;           /* of the child, from wait4() */
+    struct timeval stime;
+};
+
+/*
+ * One child running on its own pty. Without -F there is exactly one session.
+ */
+struct session {
+    char *label;                /* the host list entry (fleet mode) */
+    unsigned id;                /* its index in g.sessions, for --record */
+    char **command;
+    int state;
+    pid_t pid;
+    struct session *pid_next;   /* in g.pids */
+    int fd_ptym;
+    int exit_code;
+    bool failed;                /* exit_code set by passh, not by the child */
+    bool reused;                /* --reuse found a live master */
+    char *reuse_path;           /* --reuse, NULL till reuse_command() */
+    bool master;                /* it's starting the master on reuse_path */
+
+    char *buf;                  /* for read() from ptym */
+    char *wbuf;                 /* input the child isn't ready for yet */
+    size_t woff;
+    size_t wlen;
+    size_t wsize;
+    char *cache;                /* the last line, for the fallback rules */
+    int ncache;
+    struct mstate mstate;
+    uint64_t enabled;           /* the rules still to be matched */
+    int counts[MAX_RULES];
+    char *password;             /* from the agent, NULL till prompted */
+    struct agent_req *agent;    /* asking the agent for it */
+    struct timer t_prompt;      /* -t */
+    struct timer t_ready;       /* --ready-after */
+    struct timer t_kill;        /* SIGKILL a child given up on */
+    struct timer t_open;        /* OPEN_TIMEOUT */
+    bool opening;               /* see session_opened() */
+    bool ready;
+
+    /* --supervise */
+    struct timer t_restart;
+    int restarts;
+    int backoff;                /* ms, before the next restart */
+    int64_t started;
+    int64_t down_since;         /* 0 if not restarting */
+    bool given_up;
+    int passwords_seen;
+    bool now_interactive;
+    bool passthru;              /* no more prompts, just relay the output */
+    bool unread;                /* RELAY_BUDGET used up before EAGAIN */
+    bool pktmode;               /* TIOCPKT is on, see eof_start() */
+    unsigned long long nread;   /* bytes read from the pty */
+    unsigned long long nreported;
+
+    char *line;                 /* incomplete output line (fleet mode) */
+    int nline;
+
+    void *arg;                  /* passh_start() */
+
+    char *tail;                 /* --tail, a ring of g.opt.tail bytes */
+    size_t ntail;               /* put into it since the last tail_flush() */
+
+    struct stats st;
+};
+
 static struct {
     char *progname;
     bool reset_on_exit;
+    struct timer t_eof;         /* resend EOF to the child */
+    int eof_delay;
     struct termios save_termios;
-    bool SIGCHLDed;
-    bool received_winch;
+    int fd_signal;
+#if defined(__linux__)
+    sigset_t sigmask;
+#else
+    int sig_pipe[2];
+#endif
+    sigset_t orig_sigmask;
     bool stdin_is_tty;
-    bool now_interactive;
+    bool fleet;
 
-    int fd_ptym;
+    struct session **sessions;
+    int nsessions;
+    int nalloc;
+    int nstarted;
+    int nrunning;
+    struct session *pids[PID_BUCKETS];  /* by the pid of their child */
+
+    pid_t pid;                  /* ours, and not a child's at exit */
+
+    struct outq out[NOUTS];
+    bool out_paused;            /* pty reads stopped until queues drain */
+    bool splice_ok;             /* stdout is a pipe, so splice() can be used */
+    bool sigpipe_ignored;       /* to be restored in the child */
+    struct timer t_events;      /* the `relayed' events */
+    unsigned long long events_dropped;
+
+    /* -s: non-tty stdin copied to the child's stdin pipe */
+    struct {
+        int fd;                 /* write end of the pipe, -1 when closed */
+        bool pollable;          /* stdin is a pipe or socket */
+        bool eof;
+        int watch;              /* the one of the two fds being watched */
+        char *buf;
+        int off;
+        int len;
+    } in;
+
+    /* libpassh, see passh_init() */
+    struct {
+        bool on;
+        pid_t pid;
+        jmp_buf *jmp;           /* where fatal() returns to */
+        char error[1024];
+        struct passh_callbacks cb;
+    } lib;
+
+    struct rule rules[MAX_RULES];
+    int nrules;
+    int rule_yesno;
+    int rule_prompt;
+    int rule_ready;
+    int nready;
+    int nrestarting;
+    uint64_t fallback_rules;
 
     struct {
         bool ignore_case;
@@ -86,12 +407,50 @@ static struct {
         char *password;
         char *passwd_prompt;
         char *yesno_prompt;
-        regex_t re_prompt;
-        regex_t re_yesno;
+        char **rules;
+        int nrules;
         int timeout;
         int tries;
         bool fatal_more_tries;
         char **command;
+        char *fleet_file;
+        int jobs;
+        bool stream_stdin;
+        size_t hiwat;
+        int policy;
+        int log_sync;
+        char *reuse_dir;
+        int reuse_idle;
+        int reuse_max;
+        char *pty_server;
+        char *pty_pool;
+        int pty_pool_size;
+        bool use_fork;
+        char *agent;            /* --agent: the socket to serve */
+        char *agent_fetch;
+        int agent_ttl;
+        char *agent_sock;       /* -p agent: */
+        char *agent_key;
+        int events_fd;
+        bool ready;             /* --ready, one of these: */
+        int ready_fd;
+        char *ready_file;
+        bool ready_systemd;
+        char *ready_pattern;
+        int ready_after;
+        bool supervise;
+        int supervise_max;
+        int backoff_min;
+        int backoff_max;
+        bool stats;
+        char *stats_file;
+        char *control;
+        size_t tail;
+        char *tail_file;
+        bool tail_input;
+        char *record;
+        char *replay;
+        char *asciicast;
 
         char *log_to_pty;
         char *log_from_pty;
@@ -111,21 +470,45 @@ usage(int exitcode)
 {
     printf("Usage: %s [OPTION]... COMMAND...\n"
            "\n"
+           "  -b <size>       Buffer at most <size> bytes (e.g. `64k') of output for\n"
+           "                  a slow stdout or log (Default: %d)\n"
+           "  -B <policy>     When that buffer is full: `block' (stop reading COMMAND's\n"
+           "                  output), `drop' (discard log data) or `fail' (exit)\n"
+           "                  (Default: block)\n"
            "  -c <N>          Send at most <N> passwords (0 means infinite. Default: %d)\n"
            "  -C              Exit if prompted for the <N+1>th password\n"
+           "  -e <rule>       Answer one more prompt: `/<prompt>/<response>/[flags]'.\n"
+           "                  Any char can be the delimiter. <response> and a CR are\n"
+           "                  sent when the BRE <prompt> matches. Flags: <N> (answer\n"
+           "                  at most <N> times), `C' (exit if prompted for the\n"
+           "                  <N+1>th time), `i' (ignore case), `p' (send the\n"
+           "                  password). Can be repeated\n"
+           "  -F <file>       Run COMMAND once for every host listed in <file>\n"
+           "                  (`-' for stdin). `{}' in COMMAND is replaced by the\n"
+           "                  host, or the host is appended if there's no `{}'\n"
            "  -h              Help\n"
            "  -i              Case insensitive for password prompt matching\n"
+           "  -j <N>          Run at most <N> hosts at a time with -F\n"
+           "                  (0 means no limit. Default: %d)\n"
            "  -n              Nohup the child (e.g. used for `ssh -f')\n"
            "  -p <password>   The password (Default: `" DEFAULT_PASSWD "')\n"
            "  -p env:<var>    Read password from env var\n"
            "  -p file:<file>  Read password from file\n"
            "  -p sock:<file>  Read password from UNIX socket\n"
-           "  -P <prompt>     Regexp (BRE) for the password prompt\n"
-           "                  (Default: `" DEFAULT_PROMPT "')\n"
+           "  -p agent:<file> Ask the --agent on UNIX socket <file> for the password\n"
+           "                  of --agent-key\n"
+           "  -P <prompt>     Regexp (BRE) for the password prompt, matched against\n"
+           "                  the last line of output (Default: `" DEFAULT_PROMPT "')\n"
+           "  -R <file>       Read -e rules from <file>, one per line\n"
+           "  -s              Stream stdin (if not a tty) to COMMAND's stdin through\n"
+           "                  a pipe, so binary data is passed as is\n"
            "  -l <file>       Save data written to the pty\n"
            "  -L <file>       Save data read from the pty\n"
-           "  -t <timeout>    Timeout waiting for next password prompt\n"
-           "                  (0 means no timeout. Default: %d)\n"
+           "  -S <secs>       fdatasync() the -l/-L logs every <secs> seconds\n"
+           "                  (0 means after every write. Default: never)\n"
+           "  -t <timeout>    Timeout waiting for next password prompt, in seconds\n"
+           "                  (e.g. `1.5') or ms (`500ms') (0 means no timeout.\n"
+           "                  Default: %d)\n"
            "  -T              Exit if timed out waiting for password prompt\n"
            "  -V              Show version\n"
            "  -y              Auto answer `(yes/no)?' questions\n"
@@ -133,9 +516,86 @@ usage(int exitcode)
            "  -Y <pattern>    Regexp (BRE) for the `yes/no' prompt\n"
            "                  (Default: `" DEFAULT_YESNO "')\n"
 #endif
+           "  --reuse=<dir>   COMMAND is ssh: log in through an OpenSSH master\n"
+           "                  connection kept in <dir>. If one is alive for the\n"
+           "                  host, no password is needed at all\n"
+           "  --reuse-idle=<secs>\n"
+           "                  Close a master idle for <secs> (Default: %d)\n"
+           "  --reuse-max=<N> Keep at most <N> masters in <dir>, closing the least\n"
+           "                  recently used one (Default: %d)\n"
+           "  --pty-server=<socket>\n"
+           "                  Don't run a command, but serve ready to use ptys on\n"
+           "                  the UNIX <socket> for --pty-pool\n"
+           "  --pty-pool-size=<N>\n"
+           "                  Keep <N> ptys ready in the server (Default: %d)\n"
+           "  --pty-pool=<socket>\n"
+           "                  Get the pty from a --pty-server instead of\n"
+           "                  allocating one. Falls back if it's not running\n"
+#if defined(PTY_SPAWN)
+           "  --fork          Start COMMAND with fork() rather than posix_spawn()\n"
+#endif
+           "  --events-fd=<fd>\n"
+           "                  Write events (child started, prompt answered, child\n"
+           "                  exited, ...) to <fd> as JSON, one per line\n"
+           "  --ready=fd:<fd>\n"
+           "  --ready=file:<file>\n"
+           "  --ready=systemd\n"
+           "                  Once logged in, write `READY=1' to <fd>, create <file>\n"
+           "                  or notify systemd ($NOTIFY_SOCKET)\n"
+           "  --ready-pattern=<pattern>\n"
+           "                  Regexp (BRE) meaning COMMAND is logged in\n"
+           "  --ready-after=<timeout>\n"
+           "                  Logged in if no password prompt follows the password\n"
+           "                  in <timeout>, like -t (Default without\n"
+           "                  --ready-pattern: %dms). Or when COMMAND exits with 0\n"
+           "                  after a password (e.g. `ssh -f')\n"
+           "  --supervise     Restart COMMAND when it fails (exits with non-zero),\n"
+           "                  after a delay growing from <min> to <max> (see\n"
+           "                  --backoff). Not if the password is wrong (-C)\n"
+           "  --supervise-max=<N>\n"
+           "                  Restart at most <N> times (0 means no limit.\n"
+           "                  Default: 0)\n"
+           "  --backoff=<min>,<max>\n"
+           "                  Restart delays, like -t (Default: %dms,%dms)\n"
+           "  --stats         At exit, print what passh did (bytes and syscalls,\n"
+           "                  time spent matching, latencies) to stderr, per host\n"
+           "                  with -F\n"
+           "  --stats-file=<file>\n"
+           "                  Write those to <file> at exit, in the Prometheus text\n"
+           "                  format (e.g. for node_exporter's textfile collector)\n"
+           "  --control=<socket>\n"
+           "                  Take commands on the UNIX <socket> while running:\n"
+           "                  `stats', `password [<host>]' (send it again),\n"
+           "                  `rotate' (reopen the -l/-L logs), `log on|off'\n"
+           "  --tail=<size>   Keep the last <size> bytes (e.g. `64k') of COMMAND's\n"
+           "                  output in memory and only write them out if it\n"
+           "                  fails (exits with non-zero, also after -T or -C)\n"
+           "  --tail-file=<file>\n"
+           "                  Append them to <file> rather than stderr. `{}' is\n"
+           "                  replaced by the host with -F\n"
+           "  --tail-input    Keep what's sent to COMMAND there too, like -l\n"
+           "  --record=<file> Record the session(s) to <file>, with timing\n"
+           "  --replay=<file> Don't run a command, but match a --record <file> as\n"
+           "                  fast as possible with the prompt options given,\n"
+           "                  and report the matches and the matcher's speed\n"
+           "  --asciicast=<file>\n"
+           "                  With --replay, also write the recording as an\n"
+           "                  asciicast v2 <file>. `{}' is replaced by the host\n"
+           "  --agent=<socket>\n"
+           "                  Don't run a command, but serve passwords on the UNIX\n"
+           "                  <socket> for `-p agent:'\n"
+           "  --agent-fetch=<command>\n"
+           "                  Shell command printing the password of key `$1'\n"
+           "  --agent-ttl=<secs>\n"
+           "                  Forget a password after <secs> (Default: %d)\n"
+           "  --agent-key=<key>\n"
+           "                  Key of the password to ask the agent for. `{}' is\n"
+           "                  replaced by the host with -F (Default with -F: `{}')\n"
            "\n"
            "Report bugs to Clark Wang <dearvoid@gmail.com>\n"
-           "", g.progname, DEFAULT_COUNT, DEFAULT_TIMEOUT);
+           "", g.progname, DEFAULT_HIWAT, DEFAULT_COUNT, DEFAULT_JOBS, DEFAULT_TIMEOUT,
+           DEFAULT_REUSE_IDLE, DEFAULT_REUSE_MAX, DEFAULT_PTY_POOL, DEFAULT_READY_AFTER,
+           DEFAULT_BACKOFF_MIN, DEFAULT_BACKOFF_MAX, DEFAULT_AGENT_TTL);
 
     exit(exitcode);
 }
@@ -150,6 +610,13 @@ fatal(int rcode, const char *fmt, ...)
     vsnprintf(buf, sizeof(buf), fmt, ap);
     va_end(ap);
 
+    /* back to the libpassh call, unless it's in a child which failed to
+     * exec */
+    if (g.lib.jmp != NULL && getpid() == g.lib.pid) {
+        snprintf(g.lib.error, sizeof(g.lib.error), "%s", buf);
+        longjmp(*g.lib.jmp, rcode);
+    }
+
     /* in case stdout and stderr are the same */
     fflush(stdout);
 
@@ -178,11 +645,34 @@ fatal_sys(const char *fmt, ...)
 void
 startup()
 {
+    int i;
+
     g.opt.passwd_prompt = DEFAULT_PROMPT;
     g.opt.yesno_prompt = DEFAULT_YESNO;
     g.opt.password = DEFAULT_PASSWD;
     g.opt.tries = DEFAULT_COUNT;
     g.opt.timeout = DEFAULT_TIMEOUT;
+    g.opt.jobs = DEFAULT_JOBS;
+
+    g.opt.hiwat = DEFAULT_HIWAT;
+    g.opt.policy = POLICY_BLOCK;
+    g.opt.log_sync = -1;
+    g.opt.reuse_idle = DEFAULT_REUSE_IDLE;
+    g.opt.reuse_max = DEFAULT_REUSE_MAX;
+    g.opt.pty_pool_size = DEFAULT_PTY_POOL;
+    g.opt.agent_ttl = DEFAULT_AGENT_TTL;
+    g.opt.events_fd = -1;
+    g.opt.ready_fd = -1;
+    g.opt.ready_after = -1;
+    g.opt.backoff_min = DEFAULT_BACKOFF_MIN;
+    g.opt.backoff_max = DEFAULT_BACKOFF_MAX;
+
+    for (i = 0; i < NOUTS; ++i) {
+        g.out[i].fd = -1;
+        g.out[i].orig_flags = -1;
+    }
+    g.in.fd = -1;
+    g.in.watch = -1;
 }
 
 ssize_t
@@ -264,774 +754,7174 @@ arg2pass(char *optarg)
     return pass;
 }
 
-void
-getargs(int argc, char **argv)
+/*
+ * "1.5", "1.5s" or "1500ms" to 1500. Returns -1 if it's not valid.
+ */
+int
+arg2ms(const char *arg)
 {
-    int ch, i, r, reflag;
+    char *end;
+    double v;
 
-    if ((g.progname = strrchr(argv[0], '/')) != NULL) {
-        ++g.progname;
-    } else {
-        g.progname = argv[0];
+    v = strtod(arg, &end);
+    if (end == arg || v < 0 || v > INT_MAX / 1000) {
+        return -1;
     }
-
-    if (argc == 1 || (argc == 2 && strcmp("--help", argv[1]) == 0) ) {
-        usage(0);
+    if (strcmp(end, "ms") == 0) {
+        return (int) v;
+    } else if (strcmp(end, "s") == 0 || *end == '\0') {
+        return (int) (v * 1000);
     }
+    return -1;
+}
 
-    if (argc == 2 && strcmp("--version", argv[1]) == 0) {
-        show_version();
+/*
+ * "4096", "64k" or "1M" to bytes. Returns 0 if it's not valid.
+ */
+size_t
+arg2size(const char *arg)
+{
+    unsigned long v;
+    char *end;
+
+    if (! isdigit((unsigned char) *arg) ) {
+        return 0;
     }
+    v = strtoul(arg, &end, 10);
+    if (*end == 'k' || *end == 'K') {
+        v = v <= ULONG_MAX / 1024 ? v * 1024 : 0;
+        ++end;
+    } else if (*end == 'm' || *end == 'M') {
+        v = v <= ULONG_MAX / (1024 * 1024) ? v * 1024 * 1024 : 0;
+        ++end;
+    }
+    return *end == '\0' ? v : 0;
+}
 
-    /*
-     * If the first character of optstring is '+' or the environment variable
-     * POSIXLY_CORRECT is set, then option processing stops as soon as a
-     * nonoption argument is encountered.
-     */
-    while ((ch = getopt(argc, argv, "+:c:Chil:L:np:P:t:TVy")) != -1) {
-        switch (ch) {
-            case 'c':
-                g.opt.tries = atoi(optarg);
-                break;
-            case 'C':
-                g.opt.fatal_more_tries = true;
-                break;
-            case 'h':
-                usage(0);
+/*
+ * A count like "0" or "32". Returns -1 if it's not valid.
+ */
+int
+arg2int(const char *arg)
+{
+    long v;
+    char *end;
 
-            case 'i':
-                g.opt.ignore_case = true;
-                break;
+    if (! isdigit((unsigned char) *arg) ) {
+        return -1;
+    }
+    errno = 0;
+    v = strtol(arg, &end, 10);
+    if (*end != '\0' || errno != 0 || v > INT_MAX) {
+        return -1;
+    }
+    return (int) v;
+}
 
-            case 'l':
-                g.opt.log_to_pty = optarg;
-                break;
+/*
+ * The prompt matcher.
+ *
+ * The patterns of all the rules are compiled into one NFA (Thompson's
+ * construction) which is turned into a DFA lazily, one transition at a
+ * time, while the output is being scanned. So every byte of output is
+ * looked at only once, no matter how many rules there are.
+ *
+ * Only POSIX BREs are supported here. A pattern using anything else (e.g.
+ * back-references or GNU extensions like `\|') is left to regexec(). Just
+ * like matching the last line of output with regexec(), a match never
+ * crosses a newline, `^' matches at the beginning of a line (or right after
+ * the previous match) and `$' matches at the end of the output read so far.
+ */
+#define NFA_MAX          4096
+#define DFA_MAX          1024
+
+#define N_SET            0     /* consume a byte in m.sets[arg] */
+#define N_SPLIT          1     /* epsilon to `out' and `out1' */
+#define N_BOL            2     /* epsilon to `out' at the beginning of a line */
+#define N_MATCH          3     /* rule `arg' matched */
+
+#define R_SET            0
+#define R_CAT            1
+#define R_REPEAT         2
+#define R_EMPTY          3
+
+struct nfa_state {
+    int op;
+    int out, out1;
+    int arg;
+    bool eol;                   /* N_MATCH: only at the end of the output */
+};
+
+struct dfa_state {
+    int *nfa;                   /* sorted N_SET and N_MATCH states */
+    int n;
+    uint64_t match;
+    uint64_t match_eol;
+    unsigned hash;
+    int chain;
+    int next[256];              /* -1 if not computed yet */
+};
+
+/* parsed BRE */
+struct re_node {
+    int type;
+    int set;
+    int min, max;               /* R_REPEAT, max < 0 means no limit */
+    struct re_node *left, *right;
+};
+
+#define DFA_HASHSIZE     1024
 
-            case 'L':
-                g.opt.log_from_pty = optarg;
-                break;
+static struct {
+    struct nfa_state *nfa;
+    int nnfa;
+    unsigned char (*sets)[32];
+    int nsets;
+    int starts[MAX_RULES];
+    int nstarts;
+
+    struct dfa_state *dfa;      /* dfa[0] is the state at the beginning of a line */
+    int ndfa;
+    int nalloc;
+    int htab[DFA_HASHSIZE];
+    unsigned epoch;             /* bumped when the DFA is thrown away */
+    bool icase;                 /* the pattern being compiled */
+
+    /* for computing closures */
+    int *stack;
+    int *list;
+    unsigned *mark;
+    unsigned gen;
+} m;
+
+static int
+nfa_new(int op, int out, int out1, int arg)
+{
+    struct nfa_state *st;
 
-            case 'n':
-                g.opt.nohup_child = true;
-                break;
+    if (m.nnfa == NFA_MAX) {
+        return -1;
+    }
+    if (m.nfa == NULL && (m.nfa = malloc(NFA_MAX * sizeof(struct nfa_state) ) ) == NULL) {
+        fatal_sys("malloc");
+    }
+    st = &m.nfa[m.nnfa];
+    st->op = op;
+    st->out = out;
+    st->out1 = out1;
+    st->arg = arg;
+    st->eol = false;
+    return m.nnfa++;
+}
 
-            case 'p':
-                g.opt.password = arg2pass(optarg);
-                for (i = 0; i < strlen(optarg); ++i) {
-                    optarg[i] = '*';
-                }
-                if (g.opt.password == NULL) {
-                    fatal(ERROR_USAGE, "Error: failed to get password");
-                }
-                break;
+static int
+set_new(void)
+{
+    if (m.nsets % 64 == 0) {
+        m.sets = realloc(m.sets, (m.nsets + 64) * sizeof(*m.sets) );
+        if (m.sets == NULL) {
+            fatal_sys("realloc");
+        }
+    }
+    memset(m.sets[m.nsets], 0, sizeof(*m.sets) );
+    return m.nsets++;
+}
 
-            case 'P':
-                g.opt.passwd_prompt = optarg;
-                break;
+#define SET_ADD(set, c)  (m.sets[set][(unsigned char) (c) >> 3] |= 1 << ((c) & 7) )
+#define SET_HAS(set, c)  (m.sets[set][(unsigned char) (c) >> 3] & 1 << ((c) & 7) )
 
-            case 't':
-                g.opt.timeout = atoi(optarg);
-                break;
+/* for REG_ICASE */
+static void
+set_fold(int set)
+{
+    int c;
 
-            case 'T':
-                g.opt.fatal_no_prompt = true;
-                break;
+    if (m.icase) {
+        for (c = 0; c < 256; ++c) {
+            if (SET_HAS(set, c) ) {
+                SET_ADD(set, tolower(c) );
+                SET_ADD(set, toupper(c) );
+            }
+        }
+    }
+}
 
-            case 'V':
-                show_version();
-                break;
+static struct re_node *
+re_node(int type, struct re_node *left, struct re_node *right)
+{
+    struct re_node *node;
 
-            case 'y':
-                g.opt.auto_yesno = true;
-                break;
-#if 0
-            case 'Y':
-                g.opt.yesno_prompt = optarg;
-                break;
-#endif
-            case ':':
-                fatal(ERROR_USAGE, "Error: option '-%c' requires an argument", optopt);
-                break;
+    if ((node = calloc(1, sizeof(struct re_node) ) ) == NULL) {
+        fatal_sys("calloc");
+    }
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    return node;
+}
 
-            case '?':
-            default:
-                fatal(ERROR_USAGE, "Error: unknown option '-%c'", optopt);
-        }
+static void
+re_free(struct re_node *node)
+{
+    if (node != NULL) {
+        re_free(node->left);
+        re_free(node->right);
+        free(node);
     }
-    argc -= optind;
-    argv += optind;
+}
 
-    if (0 == argc) {
-        fatal(ERROR_USAGE, "Error: no command specified");
+static bool
+re_class(int set, const char *name, size_t len)
+{
+    static const struct {
+        const char *name;
+        int (*fn)(int);
+    } classes[] = {
+        { "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank },
+        { "cntrl", iscntrl }, { "digit", isdigit }, { "graph", isgraph },
+        { "lower", islower }, { "print", isprint }, { "punct", ispunct },
+        { "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit },
+    };
+    int i, c;
+
+    for (i = 0; i < sizeof(classes) / sizeof(classes[0]); ++i) {
+        if (strlen(classes[i].name) == len
+            && strncmp(classes[i].name, name, len) == 0) {
+            for (c = 0; c < 128; ++c) {
+                if (classes[i].fn(c) ) {
+                    SET_ADD(set, c);
+                }
+            }
+            return true;
+        }
     }
-    g.opt.command = argv;
+    return false;
+}
 
-    if (0 == strlen(g.opt.passwd_prompt) ) {
-        fatal(ERROR_USAGE, "Error: empty prompt");
+/*
+ * Parse a bracket expression. `*pp' points to the char after `['.
+ */
+static int
+re_bracket(const char **pp)
+{
+    const char *p = *pp, *end;
+    bool negate = false, first = true;
+    int set = set_new();
+    int lo, hi, c;
+
+    if (*p == '^') {
+        negate = true;
+        ++p;
     }
+    while (first || *p != ']') {
+        first = false;
+        if (*p == '\0') {
+            return -1;
+        }
+        if (p[0] == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.') ) {
+            char delim[3] = { p[1], ']', '\0' };
 
-    /* Password: */
-    reflag = 0;
-    reflag |= g.opt.ignore_case ? REG_ICASE : 0;
-    r = regcomp(&g.opt.re_prompt, g.opt.passwd_prompt, reflag);
-    if (r != 0) {
-        fatal(ERROR_USAGE, "Error: invalid RE for password prompt");
+            if ((end = strstr(p + 2, delim) ) == NULL) {
+                return -1;
+            }
+            if (p[1] == ':') {
+                if (! re_class(set, p + 2, end - (p + 2) ) ) {
+                    return -1;
+                }
+                p = end + 2;
+                continue;
+            }
+            /* only single-char collating elements and equivalence classes */
+            if (end - (p + 2) != 1) {
+                return -1;
+            }
+            lo = (unsigned char) p[2];
+            p = end + 2;
+        } else {
+            lo = (unsigned char) *p++;
+        }
+        hi = lo;
+        if (p[0] == '-' && p[1] != ']' && p[1] != '\0') {
+            if (p[1] == '[') {
+                return -1;
+            }
+            hi = (unsigned char) p[1];
+            p += 2;
+            if (hi < lo) {
+                return -1;
+            }
+        }
+        for (c = lo; c <= hi; ++c) {
+            SET_ADD(set, c);
+        }
     }
-    /* (yes/no)? */
-    r = regcomp(&g.opt.re_yesno, g.opt.yesno_prompt, reflag);
-    if (r != 0) {
-        fatal(ERROR_USAGE, "Error: invalid RE for yes/no prompt");
+    *pp = p + 1;
+
+    set_fold(set);
+    if (negate) {
+        for (c = 0; c < 32; ++c) {
+            m.sets[set][c] = ~m.sets[set][c];
+        }
     }
+    return set;
 }
 
-int
-ptym_open(char *pts_name, int pts_namesz)
+/*
+ * Parse a BRE until the end of the string or `\)'. Returns NULL if the
+ * pattern uses anything we don't support.
+ */
+static struct re_node *
+re_parse(const char **pp, int depth)
 {
-    char *ptr;
-    int fdm;
-
-    snprintf(pts_name, pts_namesz, "/dev/ptmx");
-
-    fdm = posix_openpt(O_RDWR);
-    if (fdm < 0)
-        return (-1);
+    const char *p = *pp;
+    struct re_node *seq = re_node(R_EMPTY, NULL, NULL), *atom;
+    bool at_start = true;
+    char *end;
+    int set, min, max;
+
+    while (*p != '\0') {
+        if (p[0] == '\\' && p[1] == ')') {
+            break;
+        }
 
-    if (grantpt(fdm) < 0) {
-        close(fdm);
-        return (-2);
-    }
+        atom = NULL;
+        set = -1;
+        if (*p == '.') {
+            set = set_new();
+            memset(m.sets[set], 0xff, sizeof(*m.sets) );
+            ++p;
+        } else if (*p == '[') {
+            ++p;
+            if ((set = re_bracket(&p) ) < 0) {
+                goto unsupported;
+            }
+        } else if (*p == '*' && at_start) {
+            set = set_new();
+            SET_ADD(set, '*');
+            ++p;
+        } else if (*p == '^') {
+            /* an anchor only at the very beginning, see re_compile() */
+            if (at_start && depth > 0) {
+                goto unsupported;
+            }
+            set = set_new();
+            SET_ADD(set, '^');
+            ++p;
+        } else if (*p == '$') {
+            /* an anchor only at the very end, see re_compile() */
+            if (p[1] == '\\' && p[2] == ')') {
+                goto unsupported;
+            }
+            set = set_new();
+            SET_ADD(set, '$');
+            ++p;
+        } else if (p[0] == '\\' && p[1] == '(') {
+            p += 2;
+            if ((atom = re_parse(&p, depth + 1) ) == NULL) {
+                goto unsupported;
+            }
+            if (p[0] != '\\' || p[1] != ')') {
+                re_free(atom);
+                goto unsupported;
+            }
+            p += 2;
+        } else if (p[0] == '\\') {
+            if (p[1] == '\0' || strchr(".[]*^$\\", p[1]) == NULL) {
+                /* back-references, `\{' at the start, GNU extensions, ... */
+                goto unsupported;
+            }
+            set = set_new();
+            SET_ADD(set, p[1]);
+            p += 2;
+        } else {
+            set = set_new();
+            SET_ADD(set, *p);
+            ++p;
+        }
+        if (atom == NULL) {
+            set_fold(set);
+            atom = re_node(R_SET, NULL, NULL);
+            atom->set = set;
+        }
+        at_start = false;
+
+        /* `*' and `\{m,n\}' */
+        while (true) {
+            if (*p == '*') {
+                min = 0;
+                max = -1;
+                ++p;
+            } else if (p[0] == '\\' && p[1] == '{') {
+                min = strtol(p + 2, &end, 10);
+                if (end == p + 2) {
+                    re_free(atom);
+                    goto unsupported;
+                }
+                max = min;
+                if (*end == ',') {
+                    max = strtol(end + 1, &end, 10);
+                    if (end[-1] == ',') {
+                        max = -1;
+                    }
+                }
+                if (end[0] != '\\' || end[1] != '}' || min > RE_DUP_MAX
+                    || max > RE_DUP_MAX || (max >= 0 && max < min) ) {
+                    re_free(atom);
+                    goto unsupported;
+                }
+                p = end + 2;
+            } else {
+                break;
+            }
+            atom = re_node(R_REPEAT, atom, NULL);
+            atom->min = min;
+            atom->max = max;
+        }
 
-    if (unlockpt(fdm) < 0) {
-        close(fdm);
-        return (-3);
+        seq = re_node(R_CAT, seq, atom);
     }
 
-    if ((ptr = ptsname(fdm)) == NULL) {
-        close(fdm);
-        return (-4);
-    }
+    *pp = p;
+    return seq;
 
-    snprintf(pts_name, pts_namesz, "%s", ptr);
-    return (fdm);
+unsupported:
+    re_free(seq);
+    return NULL;
 }
 
-int
-ptys_open(char *pts_name)
+/*
+ * Thompson's construction, backwards: returns the state which matches
+ * `node' and then continues to `next'.
+ */
+static int
+re_nfa(struct re_node *node, int next)
 {
-    int fds;
+    int i, s, body;
 
-    if ((fds = open(pts_name, O_RDWR)) < 0)
-        return (-5);
-    return (fds);
-}
+    if (next < 0) {
+        return -1;
+    }
 
-pid_t
-pty_fork(int *ptrfdm, char *slave_name, int slave_namesz,
-    const struct termios *slave_termios,
-    const struct winsize *slave_winsize)
-{
-    int fdm, fds;
-    pid_t pid;
-    char pts_name[32];
+    switch (node->type) {
+        case R_EMPTY:
+            return next;
 
-    if ((fdm = ptym_open(pts_name, sizeof(pts_name))) < 0)
-        fatal_sys("can't open master pty: %s, error %d", pts_name, fdm);
+        case R_SET:
+            return nfa_new(N_SET, next, -1, node->set);
 
-    if (slave_name != NULL) {
-        /*
-         * Return name of slave.  Null terminate to handle case
-         * where strlen(pts_name) > slave_namesz.
-         */
-        snprintf(slave_name, slave_namesz, "%s", pts_name);
+        case R_CAT:
+            return re_nfa(node->left, re_nfa(node->right, next) );
+
+        case R_REPEAT:
+        default:
+            if (node->max < 0) {
+                /* a loop */
+                if ((s = nfa_new(N_SPLIT, -1, next, 0) ) < 0) {
+                    return -1;
+                }
+                if ((body = re_nfa(node->left, s) ) < 0) {
+                    return -1;
+                }
+                m.nfa[s].out = body;
+            } else {
+                /* (a(a(a)?)?)? */
+                s = next;
+                for (i = node->min; i < node->max; ++i) {
+                    if ((body = re_nfa(node->left, s) ) < 0) {
+                        return -1;
+                    }
+                    if ((s = nfa_new(N_SPLIT, body, next, 0) ) < 0) {
+                        return -1;
+                    }
+                }
+            }
+            for (i = 0; i < node->min; ++i) {
+                s = re_nfa(node->left, s);
+            }
+            return s;
     }
+}
 
-    if ((pid = fork()) < 0) {
-        return (-1);
-    } else if (pid == 0) {
-        /*
-         * child
-         */
-        if (setsid() < 0)
-            fatal_sys("setsid error");
+/*
+ * Add the states reachable from `seed' via epsilon moves to m.list.
+ */
+static void
+nfa_closure(int seed, bool bol, int *nlist)
+{
+    int top = 0, st;
 
-        /*
-         * System V acquires controlling terminal on open().
-         */
-        if ((fds = ptys_open(pts_name)) < 0)
-            fatal_sys("can't open slave pty");
+    m.stack[top++] = seed;
+    while (top > 0) {
+        st = m.stack[--top];
+        if (st < 0 || m.mark[st] == m.gen) {
+            continue;
+        }
+        m.mark[st] = m.gen;
 
-        /* all done with master in child */
-        close(fdm);
+        switch (m.nfa[st].op) {
+            case N_SPLIT:
+                m.stack[top++] = m.nfa[st].out1;
+                m.stack[top++] = m.nfa[st].out;
+                break;
+            case N_BOL:
+                if (bol) {
+                    m.stack[top++] = m.nfa[st].out;
+                }
+                break;
+            default:
+                m.list[(*nlist)++] = st;
+                break;
+        }
+    }
+}
 
-#if defined(TIOCSCTTY)
-        /*
-         * TIOCSCTTY is the BSD way to acquire a controlling terminal.
-         *
-         * Don't check the return code. It would fail in Cygwin.
-         */
-        ioctl(fds, TIOCSCTTY, (char *)0);
-#endif
-        /*
-         * Set slave's termios and window size.
-         */
-        if (slave_termios != NULL) {
-            if (tcsetattr(fds, TCSANOW, slave_termios) < 0)
-                fatal_sys("tcsetattr error on slave pty");
+static void dfa_reset(void);
+static int dfa_intern(int n);
+void matcher_reset(struct mstate *ms);
+
+static int
+int_cmp(const void *a, const void *b)
+{
+    return *(const int *) a - *(const int *) b;
+}
+
+/*
+ * Find or add the DFA state for the `n' states in m.list.
+ */
+static int
+dfa_intern(int n)
+{
+    struct dfa_state *d;
+    unsigned hash = 0;
+    int i, idx;
+
+    qsort(m.list, n, sizeof(int), int_cmp);
+    for (i = 0; i < n; ++i) {
+        hash = hash * 31 + m.list[i];
+    }
+
+    for (idx = m.htab[hash % DFA_HASHSIZE]; idx >= 0; idx = m.dfa[idx].chain) {
+        d = &m.dfa[idx];
+        if (d->hash == hash && d->n == n
+            && memcmp(d->nfa, m.list, n * sizeof(int) ) == 0) {
+            return idx;
         }
-        if (slave_winsize != NULL) {
-            if (ioctl(fds, TIOCSWINSZ, slave_winsize) < 0)
-                fatal_sys("TIOCSWINSZ error on slave pty");
+    }
+
+    if (m.ndfa == DFA_MAX) {
+        /* Too many states (very unlikely for prompts). Start over. */
+        int *saved;
+
+        if ((saved = malloc(n * sizeof(int) + 1) ) == NULL) {
+            fatal_sys("malloc");
+        }
+        memcpy(saved, m.list, n * sizeof(int) );
+        dfa_reset();
+        memcpy(m.list, saved, n * sizeof(int) );
+        free(saved);
+        return dfa_intern(n);
+    }
+    if (m.ndfa == m.nalloc) {
+        m.nalloc = m.nalloc ? 2 * m.nalloc : 16;
+        m.dfa = realloc(m.dfa, m.nalloc * sizeof(struct dfa_state) );
+        if (m.dfa == NULL) {
+            fatal_sys("realloc");
         }
+    }
 
-        /*
-         * Slave becomes stdin/stdout/stderr of child.
-         */
-        if (dup2(fds, STDIN_FILENO) != STDIN_FILENO)
-            fatal_sys("dup2 error to stdin");
-        if (dup2(fds, STDOUT_FILENO) != STDOUT_FILENO)
-            fatal_sys("dup2 error to stdout");
-        if (dup2(fds, STDERR_FILENO) != STDERR_FILENO)
-            fatal_sys("dup2 error to stderr");
-        if (fds != STDIN_FILENO && fds != STDOUT_FILENO &&
-            fds != STDERR_FILENO) {
-            close(fds);
+    idx = m.ndfa++;
+    d = &m.dfa[idx];
+    if ((d->nfa = malloc(n * sizeof(int) + 1) ) == NULL) {
+        fatal_sys("malloc");
+    }
+    memcpy(d->nfa, m.list, n * sizeof(int) );
+    d->n = n;
+    d->hash = hash;
+    d->chain = m.htab[hash % DFA_HASHSIZE];
+    m.htab[hash % DFA_HASHSIZE] = idx;
+
+    d->match = d->match_eol = 0;
+    for (i = 0; i < n; ++i) {
+        if (m.nfa[d->nfa[i]].op == N_MATCH) {
+            if (m.nfa[d->nfa[i]].eol) {
+                d->match_eol |= (uint64_t) 1 << m.nfa[d->nfa[i]].arg;
+            } else {
+                d->match |= (uint64_t) 1 << m.nfa[d->nfa[i]].arg;
+            }
         }
+    }
 
-        return (0);
-    } else {
-        /*
-         * parent
-         */
-        *ptrfdm = fdm;
-        return (pid);
+    for (i = 0; i < 256; ++i) {
+        d->next[i] = -1;
     }
+    /* a match never crosses lines */
+    d->next['\n'] = 0;
+
+    return idx;
 }
 
-int
-tty_raw(int fd, struct termios *save_termios)
+/*
+ * The NFA states of a session's DFA state are saved before the DFA is
+ * thrown away so matcher_resume() can find it again: a prompt split over
+ * two reads still matches.
+ */
+static void
+matcher_save(struct mstate *ms)
 {
-    int err;
-    struct termios buf;
+    free(ms->nfa);
+    ms->nfa = NULL;
+    if (ms->state == 0) {
+        return;
+    }
+    if ((ms->nfa = malloc(m.dfa[ms->state].n * sizeof(int) + 1) ) == NULL) {
+        fatal_sys("malloc");
+    }
+    memcpy(ms->nfa, m.dfa[ms->state].nfa, m.dfa[ms->state].n * sizeof(int) );
+    ms->n = m.dfa[ms->state].n;
+}
 
-    if (tcgetattr(fd, &buf) < 0)
-        return (-1);
-    *save_termios = buf;
+static void
+matcher_resume(struct mstate *ms)
+{
+    int *nfa = ms->nfa;
 
-    /*
-     * Echo off, canonical mode off, extended input
-     * processing off, signal chars off.
-     */
-    buf.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    ms->nfa = NULL;
+    if (nfa == NULL) {
+        matcher_reset(ms);
+        return;
+    }
+    memcpy(m.list, nfa, ms->n * sizeof(int) );
+    free(nfa);
+    ms->state = dfa_intern(ms->n);
+    ms->epoch = m.epoch;
+}
 
-    /*
-     * No SIGINT on BREAK, CR-to-NL off, input parity
-     * check off, don't strip 8th bit on input, output
-     * flow control off.
-     */
-    buf.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+/*
+ * Throw away all the DFA states and add the one at the beginning of a line
+ * (always dfa[0]).
+ */
+static void
+dfa_reset(void)
+{
+    int i, n = 0;
 
-    /*
-     * Clear size bits, parity checking off.
-     */
-    buf.c_cflag &= ~(CSIZE | PARENB);
+    for (i = 0; i < g.nsessions; ++i) {
+        if (g.sessions[i]->mstate.epoch == m.epoch) {
+            matcher_save(&g.sessions[i]->mstate);
+        }
+    }
+    for (i = 0; i < m.ndfa; ++i) {
+        free(m.dfa[i].nfa);
+    }
+    m.ndfa = 0;
+    memset(m.htab, 0xff, sizeof(m.htab) );
+    ++m.epoch;
 
-    /*
-     * Set 8 bits/char.
-     */
-    buf.c_cflag |= CS8;
+    ++m.gen;
+    for (i = 0; i < m.nstarts; ++i) {
+        nfa_closure(m.starts[i], true, &n);
+    }
+    dfa_intern(n);
+}
 
-    /*
-     * Output processing off.
-     */
-    buf.c_oflag &= ~(OPOST);
+static int
+dfa_step(int from, int c)
+{
+    struct dfa_state *d = &m.dfa[from];
+    int i, st, n = 0, to;
+    unsigned epoch = m.epoch;
+
+    ++m.gen;
+    for (i = 0; i < d->n; ++i) {
+        st = d->nfa[i];
+        if (m.nfa[st].op == N_SET && SET_HAS(m.nfa[st].arg, c) ) {
+            nfa_closure(m.nfa[st].out, false, &n);
+        }
+    }
+    /* a match can start anywhere */
+    for (i = 0; i < m.nstarts; ++i) {
+        nfa_closure(m.starts[i], false, &n);
+    }
 
-    /*
-     * Case B: 1 byte at a time, no timer.
-     */
-    buf.c_cc[VMIN] = 1;
-    buf.c_cc[VTIME] = 0;
-    if (tcsetattr(fd, TCSAFLUSH, &buf) < 0)
-        return (-1);
+    to = dfa_intern(n);
+    if (m.epoch == epoch) {
+        m.dfa[from].next[c] = to;
+    }
+    return to;
+}
 
-    /*
-     * Verify that the changes stuck.  tcsetattr can return 0 on
-     * partial success.
-     */
-    if (tcgetattr(fd, &buf) < 0) {
-        err = errno;
-        tcsetattr(fd, TCSAFLUSH, save_termios);
-        errno = err;
-        return (-1);
+void
+matcher_reset(struct mstate *ms)
+{
+    ms->state = 0;
+    ms->epoch = m.epoch;
+}
+
+/*
+ * Compile `pattern' for rule `rule'. Returns false if the pattern is not
+ * supported (the caller should use regexec() for it).
+ */
+bool
+matcher_add(const char *pattern, bool icase, int rule)
+{
+    struct re_node *ast;
+    const char *p = pattern;
+    char *pat;
+    size_t len = strlen(pattern);
+    bool bol = false, eol = false;
+    int i, nsets = m.nsets, nnfa = m.nnfa;
+    int match, start, n;
+
+    /* `^' at the very beginning and `$' at the very end are anchors */
+    if (*p == '^') {
+        bol = true;
+        ++p;
+        --len;
     }
-    if ((buf.c_lflag & (ECHO | ICANON | IEXTEN | ISIG)) ||
-        (buf.c_iflag & (BRKINT | ICRNL | INPCK | ISTRIP | IXON)) ||
-        (buf.c_cflag & (CSIZE | PARENB | CS8)) != CS8 ||
-        (buf.c_oflag & OPOST) || buf.c_cc[VMIN] != 1 ||
-        buf.c_cc[VTIME] != 0) {
-        /*
-         * Only some of the changes were made.  Restore the
-         * original settings.
-         */
-        tcsetattr(fd, TCSAFLUSH, save_termios);
-        errno = EINVAL;
-        return (-1);
+    if (len > 0 && p[len - 1] == '$') {
+        /* not if it's escaped */
+        for (i = len - 1; i > 0 && p[i - 1] == '\\'; --i)
+            ;
+        if ((len - 1 - i) % 2 == 0) {
+            eol = true;
+            --len;
+        }
+    }
+    if ((pat = malloc(len + 1) ) == NULL) {
+        fatal_sys("malloc");
     }
+    memcpy(pat, p, len);
+    pat[len] = '\0';
+    p = pat;
+    m.icase = icase;
+    ast = re_parse(&p, 0);
+    if (ast != NULL && *p != '\0') {
+        /* unmatched `\)' */
+        re_free(ast);
+        ast = NULL;
+    }
+    free(pat);
 
-    return (0);
+    if (ast == NULL) {
+        m.nsets = nsets;
+        return false;
+    }
+
+    match = nfa_new(N_MATCH, -1, -1, rule);
+    if (match >= 0) {
+        m.nfa[match].eol = eol;
+    }
+    start = re_nfa(ast, match);
+    if (bol && start >= 0) {
+        start = nfa_new(N_BOL, start, -1, 0);
+    }
+    re_free(ast);
+
+    if (start >= 0) {
+        m.stack = realloc(m.stack, (2 * m.nnfa + 2) * sizeof(int) );
+        m.list = realloc(m.list, m.nnfa * sizeof(int) );
+        m.mark = realloc(m.mark, m.nnfa * sizeof(unsigned) );
+        if (m.stack == NULL || m.list == NULL || m.mark == NULL) {
+            fatal_sys("realloc");
+        }
+        memset(m.mark, 0, m.nnfa * sizeof(unsigned) );
+        m.gen = 0;
+
+        /* A pattern matching the empty string would match everywhere. */
+        ++m.gen;
+        n = 0;
+        nfa_closure(start, true, &n);
+        for (i = 0; i < n; ++i) {
+            if (m.list[i] == match) {
+                start = -1;
+            }
+        }
+    }
+    if (start < 0) {
+        m.nnfa = nnfa;
+        m.nsets = nsets;
+        return false;
+    }
+
+    m.starts[m.nstarts++] = start;
+    dfa_reset();
+    return true;
+}
+
+/*
+ * Feed `len' bytes of output to the matcher. It stops right after the first
+ * match of a rule in `enabled'. Returns the number of bytes consumed and
+ * sets `*rule' to the rule matched, or -1.
+ */
+size_t
+matcher_feed(struct mstate *ms, const char *buf, size_t len,
+    uint64_t enabled, int *rule)
+{
+    const unsigned char *p = (const unsigned char *) buf;
+    uint64_t match;
+    int cur, next;
+    size_t i;
+
+    *rule = -1;
+    if (m.ndfa == 0) {
+        return len;
+    }
+    if (ms->epoch != m.epoch) {
+        matcher_resume(ms);
+    }
+
+    cur = ms->state;
+    for (i = 0; i < len; ++i) {
+        if ((next = m.dfa[cur].next[p[i]]) < 0) {
+            next = dfa_step(cur, p[i]);
+        }
+        cur = next;
+        if ((match = m.dfa[cur].match & enabled) != 0) {
+            for (*rule = 0; ! (match >> *rule & 1); ++*rule)
+                ;
+            /* `^' matches right after the previous match */
+            matcher_reset(ms);
+            return i + 1;
+        }
+    }
+    ms->state = cur;
+    ms->epoch = m.epoch;
+    return len;
 }
 
+/*
+ * The rule matched at the end of the output read so far (with `$'), or -1.
+ */
 int
-tty_reset(int fd, struct termios *termio)
+matcher_eol(struct mstate *ms, uint64_t enabled)
 {
-    if (tcsetattr(fd, TCSAFLUSH, termio) < 0)
-        return (-1);
-    return (0);
+    uint64_t match;
+    int rule;
+
+    if (m.ndfa == 0) {
+        return -1;
+    }
+    if (ms->epoch != m.epoch) {
+        matcher_resume(ms);
+    }
+    if ((match = m.dfa[ms->state].match_eol & enabled) == 0) {
+        return -1;
+    }
+    for (rule = 0; ! (match >> rule & 1); ++rule)
+        ;
+    matcher_reset(ms);
+    return rule;
+}
+
+/*
+ * Add a rule. Returns false if the pattern is not a valid BRE.
+ */
+bool
+rule_add(char *pattern, char *response, int max, bool fatal_more, bool icase)
+{
+    struct rule *rule;
+
+    if (g.nrules == MAX_RULES) {
+        fatal(ERROR_USAGE, "Error: too many rules (at most %d)", MAX_RULES);
+    }
+    rule = &g.rules[g.nrules];
+    rule->pattern = pattern;
+    rule->response = response;
+    rule->max = max;
+    rule->fatal_more = fatal_more;
+    rule->icase = icase;
+
+    if (regcomp(&rule->re, pattern, icase ? REG_ICASE : 0) != 0) {
+        return false;
+    }
+    if (! matcher_add(pattern, icase, g.nrules) ) {
+        rule->fallback = true;
+        g.fallback_rules |= (uint64_t) 1 << g.nrules;
+    }
+
+    ++g.nrules;
+    return true;
 }
 
+/*
+ * Parse a -e rule: `/<prompt>/<response>/[flags]'.
+ */
+void
+rule_parse(char *spec)
+{
+    char *fields[3] = { "", "", "" };
+    char *p, *q, *response;
+    char delim = spec[0];
+    bool fatal_more = false, icase = false, password = false;
+    int i, max = 0;
+
+    if (delim == '\0' || (p = strdup(spec + 1) ) == NULL) {
+        fatal(ERROR_USAGE, "Error: invalid rule: %s", spec);
+    }
+
+    /* split it and unescape `\<delim>' */
+    for (i = 0; i < 3 && *p != '\0'; ++i) {
+        fields[i] = q = p;
+        while (*p != '\0' && *p != delim) {
+            if (p[0] == '\\' && p[1] == delim) {
+                *q++ = delim;
+                p += 2;
+            } else if (p[0] == '\\' && p[1] != '\0') {
+                *q++ = *p++;
+                *q++ = *p++;
+            } else {
+                *q++ = *p++;
+            }
+        }
+        if (i == 0 && *p == '\0') {
+            fatal(ERROR_USAGE, "Error: invalid rule: %s", spec);
+        }
+        if (*p != '\0') {
+            ++p;
+        }
+        *q = '\0';
+    }
+    if (*fields[0] == '\0') {
+        fatal(ERROR_USAGE, "Error: empty prompt in rule: %s", spec);
+    }
+
+    for (p = fields[2]; *p != '\0'; ++p) {
+        if (isdigit((unsigned char) *p) ) {
+            max = strtol(p, &p, 10);
+            --p;
+        } else if (*p == 'C') {
+            fatal_more = true;
+        } else if (*p == 'i') {
+            icase = true;
+        } else if (*p == 'p') {
+            password = true;
+        } else {
+            fatal(ERROR_USAGE, "Error: unknown flag '%c' in rule: %s", *p, spec);
+        }
+    }
+
+    response = NULL;
+    if (! password) {
+        if ((response = malloc(strlen(fields[1]) + 2) ) == NULL) {
+            fatal_sys("malloc");
+        }
+        for (p = fields[1], q = response; *p != '\0'; ++p) {
+            if (*p == '\\' && p[1] != '\0') {
+                ++p;
+                *q++ = *p == 'r' ? '\r' : *p == 'n' ? '\n' : *p == 't' ? '\t' : *p;
+            } else {
+                *q++ = *p;
+            }
+        }
+        strcpy(q, "\r");
+    }
+
+    if (! rule_add(fields[0], response, max, fatal_more, icase) ) {
+        fatal(ERROR_USAGE, "Error: invalid RE in rule: %s", spec);
+    }
+}
+
+/*
+ * Read -e rules from a file, one per line.
+ */
+void
+rule_file(char *path)
+{
+    FILE *fp;
+    char buf[4096];
+    char *line;
+
+    if ((fp = fopen(path, "r") ) == NULL) {
+        fatal_sys("failed to open file %s", path);
+    }
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        line = strtok(buf, "\r\n");
+        if (line == NULL || *line == '#') {
+            continue;
+        }
+        g.opt.rules = realloc(g.opt.rules, (g.opt.nrules + 1) * sizeof(char *) );
+        if (g.opt.rules == NULL || (line = strdup(line) ) == NULL) {
+            fatal_sys("realloc");
+        }
+        g.opt.rules[g.opt.nrules++] = line;
+    }
+    fclose(fp);
+}
+
+void
+getargs(int argc, char **argv)
+{
+    static struct option longopts[] = {
+        { "help",       no_argument,       NULL, 'h' },
+        { "version",    no_argument,       NULL, 'V' },
+        { "reuse",      required_argument, NULL, OPT_REUSE },
+        { "reuse-idle", required_argument, NULL, OPT_REUSE_IDLE },
+        { "reuse-max",  required_argument, NULL, OPT_REUSE_MAX },
+        { "pty-server", required_argument, NULL, OPT_PTY_SERVER },
+        { "pty-pool",   required_argument, NULL, OPT_PTY_POOL },
+        { "pty-pool-size", required_argument, NULL, OPT_PTY_POOL_SIZE },
+        { "fork",       no_argument,       NULL, OPT_FORK },
+        { "agent",      required_argument, NULL, OPT_AGENT },
+        { "agent-fetch", required_argument, NULL, OPT_AGENT_FETCH },
+        { "agent-ttl",  required_argument, NULL, OPT_AGENT_TTL },
+        { "agent-key",  required_argument, NULL, OPT_AGENT_KEY },
+        { "events-fd",  required_argument, NULL, OPT_EVENTS_FD },
+        { "ready",      required_argument, NULL, OPT_READY },
+        { "ready-pattern", required_argument, NULL, OPT_READY_PATTERN },
+        { "ready-after", required_argument, NULL, OPT_READY_AFTER },
+        { "supervise",  no_argument,       NULL, OPT_SUPERVISE },
+        { "supervise-max", required_argument, NULL, OPT_SUPERVISE_MAX },
+        { "backoff",    required_argument, NULL, OPT_BACKOFF },
+        { "stats",      no_argument,       NULL, OPT_STATS },
+        { "stats-file", required_argument, NULL, OPT_STATS_FILE },
+        { "control",    required_argument, NULL, OPT_CONTROL },
+        { "tail",       required_argument, NULL, OPT_TAIL },
+        { "tail-file",  required_argument, NULL, OPT_TAIL_FILE },
+        { "tail-input", no_argument,       NULL, OPT_TAIL_INPUT },
+        { "record",     required_argument, NULL, OPT_RECORD },
+        { "replay",     required_argument, NULL, OPT_REPLAY },
+        { "asciicast",  required_argument, NULL, OPT_ASCIICAST },
+        { NULL,         0,                 NULL, 0 }
+    };
+    int ch, i;
+    char *p;
+
+    if ((g.progname = strrchr(argv[0], '/')) != NULL) {
+        ++g.progname;
+    } else {
+        g.progname = argv[0];
+    }
+
+    if (g.lib.on) {
+        optind = 1;
+    } else if (argc == 1 || (argc == 2 && strcmp("--help", argv[1]) == 0) ) {
+        usage(0);
+    }
+
+    if (argc == 2 && strcmp("--version", argv[1]) == 0) {
+        show_version();
+    }
+
+    /*
+     * If the first character of optstring is '+' or the environment variable
+     * POSIXLY_CORRECT is set, then option processing stops as soon as a
+     * nonoption argument is encountered.
+     */
+    while ((ch = getopt_long(argc, argv, "+:b:B:c:Ce:F:hij:l:L:np:P:R:sS:t:TVy",
+                             longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'b':
+                if ((g.opt.hiwat = arg2size(optarg) ) == 0) {
+                    fatal(ERROR_USAGE, "Error: invalid buffer size: %s", optarg);
+                }
+                break;
+
+            case 'B':
+                if (strcmp(optarg, "block") == 0) {
+                    g.opt.policy = POLICY_BLOCK;
+                } else if (strcmp(optarg, "drop") == 0) {
+                    g.opt.policy = POLICY_DROP;
+                } else if (strcmp(optarg, "fail") == 0) {
+                    g.opt.policy = POLICY_FAIL;
+                } else {
+                    fatal(ERROR_USAGE, "Error: unknown policy: %s", optarg);
+                }
+                break;
+
+            case 'c':
+                g.opt.tries = atoi(optarg);
+                break;
+            case 'C':
+                g.opt.fatal_more_tries = true;
+                break;
+            case 'e':
+                g.opt.rules = realloc(g.opt.rules, (g.opt.nrules + 1) * sizeof(char *) );
+                if (g.opt.rules == NULL) {
+                    fatal_sys("realloc");
+                }
+                g.opt.rules[g.opt.nrules++] = optarg;
+                break;
+
+            case 'F':
+                g.opt.fleet_file = optarg;
+                break;
+
+            case 'h':
+                if (g.lib.on) {
+                    fatal(ERROR_USAGE, "Error: no -h in the library");
+                }
+                usage(0);
+
+            case 'i':
+                g.opt.ignore_case = true;
+                break;
+
+            case 'j':
+                if ((g.opt.jobs = arg2int(optarg) ) < 0) {
+                    fatal(ERROR_USAGE, "Error: invalid number of jobs: %s", optarg);
+                }
+                break;
+
+            case 'l':
+                g.opt.log_to_pty = optarg;
+                break;
+
+            case 'L':
+                g.opt.log_from_pty = optarg;
+                break;
+
+            case 'n':
+                g.opt.nohup_child = true;
+                break;
+
+            case 'p':
+                if (strncmp(optarg, "agent:", 6) == 0) {
+                    /* asked for when prompted, see session_password() */
+                    g.opt.agent_sock = optarg + 6;
+                    break;
+                }
+                g.opt.password = arg2pass(optarg);
+                for (i = 0; i < strlen(optarg); ++i) {
+                    optarg[i] = '*';
+                }
+                if (g.opt.password == NULL) {
+                    fatal(ERROR_USAGE, "Error: failed to get password");
+                }
+                break;
+
+            case 'P':
+                g.opt.passwd_prompt = optarg;
+                break;
+
+            case 'R':
+                rule_file(optarg);
+                break;
+
+            case 's':
+                g.opt.stream_stdin = true;
+                break;
+
+            case 'S':
+                if ((g.opt.log_sync = arg2int(optarg) ) < 0) {
+                    fatal(ERROR_USAGE, "Error: invalid sync interval: %s", optarg);
+                }
+                break;
+
+            case 't':
+                if ((g.opt.timeout = arg2ms(optarg) ) < 0) {
+                    fatal(ERROR_USAGE, "Error: invalid timeout: %s", optarg);
+                }
+                break;
+
+            case 'T':
+                g.opt.fatal_no_prompt = true;
+                break;
+
+            case 'V':
+                if (g.lib.on) {
+                    fatal(ERROR_USAGE, "Error: no -V in the library");
+                }
+                show_version();
+                break;
+
+            case 'y':
+                g.opt.auto_yesno = true;
+                break;
+#if 0
+            case 'Y':
+                g.opt.yesno_prompt = optarg;
+                break;
+#endif
+
+            case OPT_REUSE:
+                if (strchr(optarg, '%') != NULL) {
+                    fatal(ERROR_USAGE, "Error: `%%' not allowed in --reuse dir");
+                }
+                g.opt.reuse_dir = optarg;
+                break;
+            case OPT_REUSE_IDLE:
+                if ((g.opt.reuse_idle = atoi(optarg) ) <= 0) {
+                    fatal(ERROR_USAGE, "Error: invalid idle time: %s", optarg);
+                }
+                break;
+            case OPT_REUSE_MAX:
+                if ((g.opt.reuse_max = atoi(optarg) ) <= 0) {
+                    fatal(ERROR_USAGE, "Error: invalid number of masters: %s", optarg);
+                }
+                break;
+            case OPT_PTY_SERVER:
+                g.opt.pty_server = optarg;
+                break;
+            case OPT_PTY_POOL:
+                g.opt.pty_pool = optarg;
+                break;
+            case OPT_PTY_POOL_SIZE:
+                if ((g.opt.pty_pool_size = atoi(optarg) ) <= 0) {
+                    fatal(ERROR_USAGE, "Error: invalid pool size: %s", optarg);
+                }
+                break;
+            case OPT_FORK:
+                g.opt.use_fork = true;
+                break;
+
+            case OPT_AGENT:
+                g.opt.agent = optarg;
+                break;
+            case OPT_AGENT_FETCH:
+                g.opt.agent_fetch = optarg;
+                break;
+            case OPT_AGENT_TTL:
+                if ((g.opt.agent_ttl = atoi(optarg) ) <= 0) {
+                    fatal(ERROR_USAGE, "Error: invalid TTL: %s", optarg);
+                }
+                break;
+            case OPT_AGENT_KEY:
+                g.opt.agent_key = optarg;
+                break;
+
+            case OPT_READY:
+                g.opt.ready = true;
+                if (strncmp(optarg, "fd:", 3) == 0) {
+                    g.opt.ready_fd = atoi(optarg + 3);
+                    if (g.opt.ready_fd < 0 || fcntl(g.opt.ready_fd, F_GETFD) < 0) {
+                        fatal(ERROR_USAGE, "Error: invalid fd: %s", optarg + 3);
+                    }
+                    fcntl(g.opt.ready_fd, F_SETFD, FD_CLOEXEC);
+                } else if (strncmp(optarg, "file:", 5) == 0) {
+                    g.opt.ready_file = optarg + 5;
+                } else if (strcmp(optarg, "systemd") == 0) {
+                    g.opt.ready_systemd = true;
+                } else {
+                    fatal(ERROR_USAGE, "Error: invalid --ready: %s", optarg);
+                }
+                break;
+            case OPT_READY_PATTERN:
+                g.opt.ready_pattern = optarg;
+                break;
+            case OPT_READY_AFTER:
+                if ((g.opt.ready_after = arg2ms(optarg) ) <= 0) {
+                    fatal(ERROR_USAGE, "Error: invalid timeout: %s", optarg);
+                }
+                break;
+
+            case OPT_SUPERVISE:
+                g.opt.supervise = true;
+                break;
+            case OPT_SUPERVISE_MAX:
+                if ((g.opt.supervise_max = arg2int(optarg) ) < 0) {
+                    fatal(ERROR_USAGE, "Error: invalid max restarts: %s", optarg);
+                }
+                break;
+            case OPT_BACKOFF:
+                if ((p = strchr(optarg, ',') ) == NULL) {
+                    fatal(ERROR_USAGE, "Error: invalid backoff: %s", optarg);
+                }
+                *p = '\0';
+                g.opt.backoff_min = arg2ms(optarg);
+                g.opt.backoff_max = arg2ms(p + 1);
+                if (g.opt.backoff_min <= 0 || g.opt.backoff_max < g.opt.backoff_min) {
+                    fatal(ERROR_USAGE, "Error: invalid backoff: %s,%s", optarg, p + 1);
+                }
+                break;
+
+            case OPT_STATS:
+                g.opt.stats = true;
+                break;
+            case OPT_STATS_FILE:
+                g.opt.stats_file = optarg;
+                break;
+            case OPT_CONTROL:
+                g.opt.control = optarg;
+                break;
+            case OPT_TAIL:
+                if ((g.opt.tail = arg2size(optarg) ) == 0) {
+                    fatal(ERROR_USAGE, "Error: invalid tail size: %s", optarg);
+                }
+                break;
+            case OPT_TAIL_FILE:
+                g.opt.tail_file = optarg;
+                break;
+            case OPT_TAIL_INPUT:
+                g.opt.tail_input = true;
+                break;
+            case OPT_RECORD:
+                g.opt.record = optarg;
+                break;
+            case OPT_REPLAY:
+                g.opt.replay = optarg;
+                break;
+            case OPT_ASCIICAST:
+                g.opt.asciicast = optarg;
+                break;
+
+            case OPT_EVENTS_FD:
+                g.opt.events_fd = atoi(optarg);
+                if (g.opt.events_fd < 0 || fcntl(g.opt.events_fd, F_GETFD) < 0) {
+                    fatal(ERROR_USAGE, "Error: invalid fd: %s", optarg);
+                }
+                break;
+
+            case ':':
+                if (optopt == 0 || optopt >= OPT_REUSE) {
+                    fatal(ERROR_USAGE, "Error: option '%s' requires an argument",
+                          argv[optind - 1]);
+                }
+                fatal(ERROR_USAGE, "Error: option '-%c' requires an argument", optopt);
+                break;
+
+            case '?':
+            default:
+                if (optopt == 0) {
+                    fatal(ERROR_USAGE, "Error: unknown option '%s'", argv[optind - 1]);
+                }
+                fatal(ERROR_USAGE, "Error: unknown option '-%c'", optopt);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (g.lib.on && (g.opt.pty_server != NULL || g.opt.agent != NULL) ) {
+        fatal(ERROR_USAGE, "Error: --pty-server and --agent are not supported in the library");
+    }
+    if (g.opt.pty_server != NULL) {
+        return;
+    }
+    if (g.opt.agent != NULL) {
+        if (g.opt.agent_fetch == NULL) {
+            fatal(ERROR_USAGE, "Error: --agent needs --agent-fetch");
+        }
+        return;
+    }
+    if (g.lib.on) {
+        if (g.opt.fleet_file != NULL || g.opt.stream_stdin || g.opt.log_to_pty != NULL
+            || g.opt.log_from_pty != NULL || g.opt.events_fd >= 0
+            || g.opt.reuse_dir != NULL || g.opt.control != NULL
+            || g.opt.record != NULL || g.opt.replay != NULL) {
+            fatal(ERROR_USAGE, "Error: -F, -s, -l, -L, --events-fd, --reuse, "
+                  "--control, --record and --replay are not supported in the library");
+        }
+    } else if (g.opt.replay != NULL) {
+        if (argc != 0) {
+            fatal(ERROR_USAGE, "Error: --replay takes no command");
+        }
+        if (g.opt.reuse_dir != NULL || g.opt.record != NULL) {
+            fatal(ERROR_USAGE, "Error: --reuse and --record cannot be used with --replay");
+        }
+    } else if (0 == argc) {
+        fatal(ERROR_USAGE, "Error: no command specified");
+    }
+    g.opt.command = argv;
+
+    if (0 == strlen(g.opt.passwd_prompt) ) {
+        fatal(ERROR_USAGE, "Error: empty prompt");
+    }
+    if (g.opt.stream_stdin && g.opt.fleet_file != NULL) {
+        fatal(ERROR_USAGE, "Error: -s cannot be used with -F");
+    }
+    if (g.opt.stream_stdin && g.opt.supervise) {
+        fatal(ERROR_USAGE, "Error: -s cannot be used with --supervise");
+    }
+    if (g.opt.tail == 0 && (g.opt.tail_file != NULL || g.opt.tail_input) ) {
+        fatal(ERROR_USAGE, "Error: --tail-file and --tail-input need --tail");
+    }
+    if (g.opt.asciicast != NULL && g.opt.replay == NULL) {
+        fatal(ERROR_USAGE, "Error: --asciicast needs --replay");
+    }
+    if (g.opt.agent_sock != NULL && g.opt.agent_key == NULL) {
+        if (g.opt.fleet_file == NULL) {
+            fatal(ERROR_USAGE, "Error: -p agent: needs --agent-key");
+        }
+        g.opt.agent_key = "{}";
+    }
+    if (g.opt.reuse_dir != NULL) {
+        char *base = strrchr(g.opt.command[0], '/');
+
+        if (strcmp(base != NULL ? base + 1 : g.opt.command[0], "ssh") != 0) {
+            fatal(ERROR_USAGE, "Error: --reuse only works with ssh");
+        }
+    }
+
+    /* -e and -R. They come first so they win over the built-in rules when
+     * more than one matches at the same place. */
+    for (i = 0; i < g.opt.nrules; ++i) {
+        rule_parse(g.opt.rules[i]);
+    }
+    /* (yes/no)? */
+    g.rule_yesno = -1;
+    if (g.opt.auto_yesno) {
+        g.rule_yesno = g.nrules;
+        if (! rule_add(g.opt.yesno_prompt, "yes\r", 0, false, g.opt.ignore_case) ) {
+            fatal(ERROR_USAGE, "Error: invalid RE for yes/no prompt");
+        }
+    }
+    /* Password: */
+    g.rule_prompt = g.nrules;
+    if (! rule_add(g.opt.passwd_prompt, NULL, g.opt.tries,
+                   g.opt.fatal_more_tries, g.opt.ignore_case) ) {
+        fatal(ERROR_USAGE, "Error: invalid RE for password prompt");
+    }
+    /* --ready-pattern */
+    g.rule_ready = -1;
+    if (! g.opt.ready && ! g.opt.supervise
+        && (g.opt.ready_pattern != NULL || g.opt.ready_after > 0) ) {
+        fatal(ERROR_USAGE, "Error: --ready-pattern and --ready-after need --ready");
+    }
+    if (g.opt.ready_pattern != NULL) {
+        g.rule_ready = g.nrules;
+        if (! rule_add(g.opt.ready_pattern, "", 1, false, g.opt.ignore_case) ) {
+            fatal(ERROR_USAGE, "Error: invalid RE for --ready-pattern");
+        }
+        g.rules[g.rule_ready].ready = true;
+    } else if ((g.opt.ready || g.opt.supervise) && g.opt.ready_after < 0) {
+        g.opt.ready_after = DEFAULT_READY_AFTER;
+    }
+}
+
+/*
+ * Replace all `from' in `str' with `to'. Returns NULL if there's no `from'.
+ */
+char *
+str_replace(const char *str, const char *from, const char *to)
+{
+    size_t nfrom = strlen(from), nto = strlen(to), n = 0;
+    const char *p, *q;
+    char *ret, *r;
+
+    for (p = str; (q = strstr(p, from)) != NULL; p = q + nfrom) {
+        ++n;
+    }
+    if (n == 0) {
+        return NULL;
+    }
+
+    if ((ret = malloc(strlen(str) - n * nfrom + n * nto + 1)) == NULL) {
+        fatal_sys("malloc");
+    }
+    r = ret;
+    for (p = str; (q = strstr(p, from)) != NULL; p = q + nfrom) {
+        memcpy(r, p, q - p);
+        r += q - p;
+        memcpy(r, to, nto);
+        r += nto;
+    }
+    strcpy(r, p);
+
+    return ret;
+}
+
+/*
+ * Build the command for one host: `{}' in the template is replaced by the
+ * host, or the host is appended if there's no `{}' at all.
+ */
+char **
+fleet_command(char **template, char *host)
+{
+    char **argv;
+    int argc, i;
+    bool replaced = false;
+
+    for (argc = 0; template[argc] != NULL; ++argc)
+        ;
+
+    if ((argv = calloc(argc + 2, sizeof(char *))) == NULL) {
+        fatal_sys("calloc");
+    }
+    for (i = 0; i < argc; ++i) {
+        if ((argv[i] = str_replace(template[i], "{}", host)) != NULL) {
+            replaced = true;
+        } else {
+            argv[i] = template[i];
+        }
+    }
+    if (! replaced) {
+        argv[argc] = host;
+    }
+
+    return argv;
+}
+
+/*
+ * Connection reuse (--reuse).
+ *
+ * The first login to a host runs ssh with `ControlMaster=auto' and
+ * `ControlPersist', so once the password has been answered as usual ssh
+ * keeps the master connection in the background, till it's been idle for
+ * --reuse-idle seconds. Later logins find the master alive and go through
+ * it without being prompted at all. A master's socket gets its mtime bumped
+ * whenever it's reused so --reuse-max can close the least recently used one.
+ */
+
+/*
+ * Run ssh with stdin and stderr on /dev/null. Its stdout is returned in
+ * `*fd_out' if that's not NULL.
+ */
+pid_t
+ssh_spawn(char **argv, int *fd_out)
+{
+    int fds[2] = { -1, -1 }, null;
+    pid_t pid;
+
+    if (fd_out != NULL && pipe(fds) < 0) {
+        fatal_sys("pipe");
+    }
+    if ((pid = fork()) < 0) {
+        fatal_sys("fork");
+    } else if (pid == 0) {
+        if ((null = open("/dev/null", O_RDWR)) < 0) {
+            _exit(127);
+        }
+        dup2(null, STDIN_FILENO);
+        dup2(fds[1] >= 0 ? fds[1] : null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    if (fd_out != NULL) {
+        close(fds[1]);
+        *fd_out = fds[0];
+    }
+    return pid;
+}
+
+int
+ssh_wait(pid_t pid)
+{
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            fatal_sys("waitpid");
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/*
+ * `ssh -G' for `command', to have it expand `<dir>/%C'.
+ */
+char **
+reuse_config_argv(char **command)
+{
+    char **argv;
+    int argc, i;
+
+    for (argc = 0; command[argc] != NULL; ++argc)
+        ;
+    if ((argv = calloc(argc + 4, sizeof(char *))) == NULL) {
+        fatal_sys("calloc");
+    }
+    argv[0] = command[0];
+    argv[1] = "-G";
+    argv[2] = "-S";
+    if ((argv[3] = malloc(strlen(g.opt.reuse_dir) + 4)) == NULL) {
+        fatal_sys("malloc");
+    }
+    sprintf(argv[3], "%s/%%C", g.opt.reuse_dir);
+    for (i = 1; i <= argc; ++i) {
+        argv[i + 3] = command[i];
+    }
+    return argv;
+}
+
+void
+reuse_config_free(char **argv)
+{
+    free(argv[3]);
+    free(argv);
+}
+
+/*
+ * The master's socket for `command', i.e. `<dir>/%C' expanded by `ssh -G'.
+ */
+char *
+reuse_path(char **command)
+{
+    char **argv, line[PATH_MAX + 32], *path = NULL;
+    int fd;
+    FILE *fp;
+    pid_t pid;
+
+    argv = reuse_config_argv(command);
+    pid = ssh_spawn(argv, &fd);
+    if ((fp = fdopen(fd, "r")) == NULL) {
+        fatal_sys("fdopen");
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "controlpath ", 12) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            if ((path = strdup(line + 12)) == NULL) {
+                fatal_sys("strdup");
+            }
+        }
+    }
+    fclose(fp);
+    if (ssh_wait(pid) != 0 || path == NULL) {
+        fatal(ERROR_GENERAL, "Error: `%s -G' failed", command[0]);
+    }
+
+    reuse_config_free(argv);
+    return path;
+}
+
+/*
+ * Whether a master is listening on `path'. A socket left behind by a dead
+ * master is removed.
+ */
+bool
+reuse_alive(char *path)
+{
+    struct sockaddr_un addr;
+    int fd, ret;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        fatal_sys("socket");
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    ret = connect(fd, (const struct sockaddr *) &addr, sizeof(addr));
+    if (ret < 0 && errno == ECONNREFUSED) {
+        unlink(path);
+    }
+    close(fd);
+
+    return ret == 0;
+}
+
+/*
+ * Whether there's no room for one more master, in which case the least
+ * recently used one is returned in `oldest' (PATH_MAX bytes). The masters
+ * of our sessions which are still logging in count too (they have no
+ * socket yet).
+ */
+bool
+reuse_full(char *oldest)
+{
+    char path[PATH_MAX];
+    struct dirent *ent;
+    struct session *s;
+    struct stat st;
+    time_t mtime = 0;
+    DIR *dir;
+    int n = 0, i, starting = 0;
+
+    for (i = 0; i < g.nstarted; ++i) {
+        s = g.sessions[i];
+        if (s->master && s->state == SESS_RUNNING && lstat(s->reuse_path, &st) < 0) {
+            ++starting;
+        }
+    }
+
+    if ((dir = opendir(g.opt.reuse_dir)) == NULL) {
+        fatal_sys("failed to open dir %s", g.opt.reuse_dir);
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        snprintf(path, sizeof(path), "%s/%s", g.opt.reuse_dir, ent->d_name);
+        if (lstat(path, &st) < 0 || ! S_ISSOCK(st.st_mode) ) {
+            continue;
+        }
+        if (n++ == 0 || st.st_mtime < mtime) {
+            mtime = st.st_mtime;
+            strcpy(oldest, path);
+        }
+    }
+    closedir(dir);
+
+    /* nothing to close if they're all still starting */
+    return n + starting >= g.opt.reuse_max && n > 0;
+}
+
+/*
+ * Make room for one more master: close the least recently used ones till
+ * there are less than --reuse-max.
+ */
+void
+reuse_evict(char *ssh)
+{
+    char oldest[PATH_MAX];
+    char *argv[] = { ssh, "-S", oldest, "-O", "exit", MY_NAME, NULL };
+
+    while (reuse_full(oldest) ) {
+        /* if that fails the master is gone anyway */
+        if (ssh_wait(ssh_spawn(argv, NULL)) != 0) {
+            unlink(oldest);
+        }
+    }
+}
+
+/*
+ * Rewrite the ssh command of `s' to go through the master on
+ * s->reuse_path, or to start it.
+ */
+void
+reuse_rewrite(struct session *s)
+{
+    char **argv, *opt;
+    int argc, i, n = 0;
+
+    for (argc = 0; s->command[argc] != NULL; ++argc)
+        ;
+    if ((argv = calloc(argc + 7, sizeof(char *))) == NULL) {
+        fatal_sys("calloc");
+    }
+
+    argv[n++] = s->command[0];
+    argv[n++] = "-S";
+    argv[n++] = s->reuse_path;
+    argv[n++] = "-o";
+    if (s->reused) {
+        argv[n++] = "ControlMaster=no";
+        utimes(s->reuse_path, NULL);
+    } else {
+        s->master = true;
+
+        argv[n++] = "ControlMaster=auto";
+        if ((opt = malloc(32)) == NULL) {
+            fatal_sys("malloc");
+        }
+        snprintf(opt, 32, "ControlPersist=%d", g.opt.reuse_idle);
+        argv[n++] = "-o";
+        argv[n++] = opt;
+    }
+    for (i = 1; i < argc; ++i) {
+        argv[n++] = s->command[i];
+    }
+    s->command = argv;
+}
+
+/*
+ * Rewrite the ssh command of `s' to go through a master.
+ */
+void
+reuse_command(struct session *s)
+{
+    s->reuse_path = reuse_path(s->command);
+    s->reused = reuse_alive(s->reuse_path);
+    if (! s->reused) {
+        reuse_evict(s->command[0]);
+    }
+    reuse_rewrite(s);
+}
+
+/*
+ * Sessions are allocated one by one as their addresses are used for the
+ * events and timers.
+ */
+struct session *
+session_new(char *label, char **command)
+{
+    struct session *s;
+
+    if (g.nsessions == g.nalloc) {
+        g.nalloc = g.nalloc ? 2 * g.nalloc : 64;
+        g.sessions = realloc(g.sessions, g.nalloc * sizeof(struct session *) );
+        if (g.sessions == NULL) {
+            fatal_sys("realloc");
+        }
+    }
+    if ((s = calloc(1, sizeof(struct session) ) ) == NULL) {
+        fatal_sys("calloc");
+    }
+    s->label = label;
+    s->command = command;
+    s->id = g.nsessions;
+    g.sessions[g.nsessions++] = s;
+    return s;
+}
+
+void
+sessions_init(void)
+{
+    FILE *fp;
+    char buf[1024];
+    char *host, *end;
+
+    if (g.opt.fleet_file == NULL) {
+        session_new(g.opt.command[0], g.opt.command);
+        return;
+    }
+
+    g.fleet = true;
+
+    if (strcmp(g.opt.fleet_file, "-") == 0) {
+        fp = stdin;
+    } else if ((fp = fopen(g.opt.fleet_file, "r")) == NULL) {
+        fatal_sys("failed to open file %s", g.opt.fleet_file);
+    }
+
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        for (host = buf; *host == ' ' || *host == '\t'; ++host)
+            ;
+        end = host + strlen(host);
+        while (end > host && strchr(" \t\r\n", end[-1]) != NULL) {
+            *--end = '\0';
+        }
+        if (*host == '\0' || *host == '#') {
+            continue;
+        }
+
+        if ((host = strdup(host)) == NULL) {
+            fatal_sys("strdup");
+        }
+        session_new(host, fleet_command(g.opt.command, host) );
+    }
+    if (fp != stdin) {
+        fclose(fp);
+    }
+
+    if (g.nsessions == 0) {
+        fatal(ERROR_USAGE, "Error: no hosts found in %s", g.opt.fleet_file);
+    }
+}
+
+void notify_ready(void);
+
+void
+reuse_init(void)
+{
+    if (mkdir(g.opt.reuse_dir, 0700) < 0 && errno != EEXIST) {
+        fatal_sys("failed to create dir %s", g.opt.reuse_dir);
+    }
+    /* -F hosts are looked up in session_start(), see reuse_lookup(), so
+     * the masters started by then count for --reuse-max */
+    if (g.fleet) {
+        return;
+    }
+    reuse_command(g.sessions[0]);
+
+    /* Nothing left for us to do if there's nothing to log, watch or
+     * restart. */
+    if (! g.fleet && g.sessions[0]->reused
+        && g.opt.log_to_pty == NULL && g.opt.log_from_pty == NULL
+        && ! g.opt.supervise && g.opt.events_fd < 0 && ! g.opt.stats
+        && g.opt.stats_file == NULL && g.opt.tail == 0 && g.opt.record == NULL
+        && g.opt.control == NULL && g.opt.ready_pattern == NULL) {
+        /* no password to wait for, it's logged in already */
+        if (g.opt.ready) {
+            notify_ready();
+        }
+        execvp(g.sessions[0]->command[0], g.sessions[0]->command);
+        fatal_sys("exec error: %s", g.sessions[0]->command[0]);
+    }
+}
+
+int
+ptym_open(char *pts_name, int pts_namesz)
+{
+    char *ptr;
+    int fdm;
+
+    snprintf(pts_name, pts_namesz, "/dev/ptmx");
+
+    fdm = posix_openpt(O_RDWR);
+    if (fdm < 0)
+        return (-1);
+
+    if (grantpt(fdm) < 0) {
+        close(fdm);
+        return (-2);
+    }
+
+    if (unlockpt(fdm) < 0) {
+        close(fdm);
+        return (-3);
+    }
+
+    if ((ptr = ptsname(fdm)) == NULL) {
+        close(fdm);
+        return (-4);
+    }
+
+    snprintf(pts_name, pts_namesz, "%s", ptr);
+    return (fdm);
+}
+
+int
+ptys_open(char *pts_name)
+{
+    int fds;
+
+    if ((fds = open(pts_name, O_RDWR)) < 0)
+        return (-5);
+    return (fds);
+}
+
+int pty_pool_take(char *path, int *fds, char *pts_name, int pts_namesz);
+
+pid_t
+pty_fork(int *ptrfdm, char *slave_name, int slave_namesz,
+    const struct termios *slave_termios,
+    const struct winsize *slave_winsize)
+{
+    int fdm, fds = -1;
+    pid_t pid;
+    char pts_name[32];
+
+    if (g.opt.pty_pool == NULL
+        || (fdm = pty_pool_take(g.opt.pty_pool, &fds, pts_name, sizeof(pts_name))) < 0) {
+        if ((fdm = ptym_open(pts_name, sizeof(pts_name))) < 0)
+            fatal_sys("can't open master pty: %s, error %d", pts_name, fdm);
+    }
+
+    /* other children (fleet mode) should not inherit it */
+    fcntl(fdm, F_SETFD, FD_CLOEXEC);
+
+    if (slave_name != NULL) {
+        /*
+         * Return name of slave.  Null terminate to handle case
+         * where strlen(pts_name) > slave_namesz.
+         */
+        snprintf(slave_name, slave_namesz, "%s", pts_name);
+    }
+
+    if ((pid = fork()) < 0) {
+        return (-1);
+    } else if (pid == 0) {
+        /*
+         * child
+         */
+        if (setsid() < 0)
+            fatal_sys("setsid error");
+
+        /*
+         * System V acquires controlling terminal on open(). A slave from
+         * the pool was opened by the server, so open it again here.
+         */
+#if defined(TIOCSCTTY)
+        if (fds < 0 && (fds = ptys_open(pts_name)) < 0)
+            fatal_sys("can't open slave pty");
+#else
+        if (fds >= 0)
+            close(fds);
+        if ((fds = ptys_open(pts_name)) < 0)
+            fatal_sys("can't open slave pty");
+#endif
+
+        /* all done with master in child */
+        close(fdm);
+
+#if defined(TIOCSCTTY)
+        /*
+         * TIOCSCTTY is the BSD way to acquire a controlling terminal.
+         *
+         * Don't check the return code. It would fail in Cygwin.
+         */
+        ioctl(fds, TIOCSCTTY, (char *)0);
+#endif
+        /*
+         * Set slave's termios and window size.
+         */
+        if (slave_termios != NULL) {
+            if (tcsetattr(fds, TCSANOW, slave_termios) < 0)
+                fatal_sys("tcsetattr error on slave pty");
+        }
+        if (slave_winsize != NULL) {
+            if (ioctl(fds, TIOCSWINSZ, slave_winsize) < 0)
+                fatal_sys("TIOCSWINSZ error on slave pty");
+        }
+
+        /*
+         * Slave becomes stdin/stdout/stderr of child.
+         */
+        if (dup2(fds, STDIN_FILENO) != STDIN_FILENO)
+            fatal_sys("dup2 error to stdin");
+        if (dup2(fds, STDOUT_FILENO) != STDOUT_FILENO)
+            fatal_sys("dup2 error to stdout");
+        if (dup2(fds, STDERR_FILENO) != STDERR_FILENO)
+            fatal_sys("dup2 error to stderr");
+        if (fds != STDIN_FILENO && fds != STDOUT_FILENO &&
+            fds != STDERR_FILENO) {
+            close(fds);
+        }
+
+        return (0);
+    } else {
+        /*
+         * parent
+         */
+        if (fds >= 0)
+            close(fds);
+        *ptrfdm = fdm;
+        return (pid);
+    }
+}
+
+#if defined(PTY_SPAWN)
+/*
+ * Like pty_fork() followed by execvp(), but without copying our address
+ * space. `fd_stdin' (if not -1) becomes the child's stdin. Returns -1 if
+ * the child could not be started, and the caller should go the pty_fork()
+ * way which reports the error from the child.
+ */
+pid_t
+pty_spawn(int *ptrfdm, char **argv, int fd_stdin,
+    const struct termios *slave_termios,
+    const struct winsize *slave_winsize)
+{
+    int fdm, fds = -1, err;
+    pid_t pid;
+    char pts_name[32];
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t sigdef;
+
+    if (g.opt.pty_pool == NULL
+        || (fdm = pty_pool_take(g.opt.pty_pool, &fds, pts_name, sizeof(pts_name))) < 0) {
+        if ((fdm = ptym_open(pts_name, sizeof(pts_name))) < 0)
+            fatal_sys("can't open master pty: %s, error %d", pts_name, fdm);
+    }
+    fcntl(fdm, F_SETFD, FD_CLOEXEC);
+
+    /*
+     * Set slave's termios and window size. The child opens the slave
+     * again itself to get it as its controlling terminal.
+     */
+    if (fds < 0 && (fds = open(pts_name, O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0)
+        fatal_sys("can't open slave pty");
+    if (slave_termios != NULL) {
+        if (tcsetattr(fds, TCSANOW, slave_termios) < 0)
+            fatal_sys("tcsetattr error on slave pty");
+    }
+    if (slave_winsize != NULL) {
+        if (ioctl(fds, TIOCSWINSZ, slave_winsize) < 0)
+            fatal_sys("TIOCSWINSZ error on slave pty");
+    }
+
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigdef);
+    if (g.sigpipe_ignored) {
+        sigaddset(&sigdef, SIGPIPE);
+    }
+    posix_spawnattr_setsigmask(&attr, &g.orig_sigmask);
+    posix_spawnattr_setsigdefault(&attr, &sigdef);
+    posix_spawnattr_setflags(&attr,
+        POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    /* setsid() is done before these */
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, pts_name, O_RDWR, 0);
+    posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO);
+    if (fd_stdin >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, fd_stdin, STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&actions, fd_stdin);
+    }
+
+    err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(fds);
+
+    if (err != 0) {
+        close(fdm);
+        return (-1);
+    }
+    *ptrfdm = fdm;
+    return (pid);
+}
+#endif
+
+int
+tty_raw(int fd, struct termios *save_termios)
+{
+    int err;
+    struct termios buf;
+
+    if (tcgetattr(fd, &buf) < 0)
+        return (-1);
+    *save_termios = buf;
+
+    /*
+     * Echo off, canonical mode off, extended input
+     * processing off, signal chars off.
+     */
+    buf.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+
+    /*
+     * No SIGINT on BREAK, CR-to-NL off, input parity
+     * check off, don't strip 8th bit on input, output
+     * flow control off.
+     */
+    buf.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+
+    /*
+     * Clear size bits, parity checking off.
+     */
+    buf.c_cflag &= ~(CSIZE | PARENB);
+
+    /*
+     * Set 8 bits/char.
+     */
+    buf.c_cflag |= CS8;
+
+    /*
+     * Output processing off.
+     */
+    buf.c_oflag &= ~(OPOST);
+
+    /*
+     * Case B: 1 byte at a time, no timer.
+     */
+    buf.c_cc[VMIN] = 1;
+    buf.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSAFLUSH, &buf) < 0)
+        return (-1);
+
+    /*
+     * Verify that the changes stuck.  tcsetattr can return 0 on
+     * partial success.
+     */
+    if (tcgetattr(fd, &buf) < 0) {
+        err = errno;
+        tcsetattr(fd, TCSAFLUSH, save_termios);
+        errno = err;
+        return (-1);
+    }
+    if ((buf.c_lflag & (ECHO | ICANON | IEXTEN | ISIG)) ||
+        (buf.c_iflag & (BRKINT | ICRNL | INPCK | ISTRIP | IXON)) ||
+        (buf.c_cflag & (CSIZE | PARENB | CS8)) != CS8 ||
+        (buf.c_oflag & OPOST) || buf.c_cc[VMIN] != 1 ||
+        buf.c_cc[VTIME] != 0) {
+        /*
+         * Only some of the changes were made.  Restore the
+         * original settings.
+         */
+        tcsetattr(fd, TCSAFLUSH, save_termios);
+        errno = EINVAL;
+        return (-1);
+    }
+
+    return (0);
+}
+
+int
+tty_reset(int fd, struct termios *termio)
+{
+    if (tcsetattr(fd, TCSAFLUSH, termio) < 0)
+        return (-1);
+    return (0);
+}
+
+void
+tty_atexit(void)
+{
+    if (g.reset_on_exit) {
+        tty_reset(STDIN_FILENO, &g.save_termios);
+    }
+}
+
+/*
+ * The event engine. It's edge-triggered epoll on Linux, so whoever gets an
+ * EV_READ event for a non-blocking fd must read() it until EAGAIN. The
+ * poll() and select() backends are level-triggered which is fine with that.
+ *
+ * NOTE: poll() does not work with ttys on macOS so select() is used there.
+ */
+#if defined(__linux__)
+#define EV_EPOLL
+#elif defined(__APPLE__)
+#define EV_SELECT
+#else
+#define EV_POLL
+#endif
+
+#define EV_READ          0x01
+#define EV_WRITE         0x02
+#define EV_EDGE          0x04  /* edge-triggered if the backend supports it */
+#define EV_MAXEVENTS     64
+
+struct ev_event {
+    int fd;
+    int events;
+    void *data;
+};
+
+static struct {
+#if defined(EV_EPOLL)
+    int epfd;
+#else
+    struct ev_event *regs;
+    int nregs;
+    int nalloc;
+#endif
+#if defined(EV_POLL)
+    struct pollfd *pfds;
+#endif
+} ev;
+
+void
+ev_init(void)
+{
+#if defined(EV_EPOLL)
+    if ((ev.epfd = epoll_create1(EPOLL_CLOEXEC) ) < 0) {
+        fatal_sys("epoll_create1");
+    }
+#endif
+}
+
+#if defined(EV_EPOLL)
+void
+ev_ctl(int op, int fd, int events, void *data)
+{
+    struct epoll_event ee;
+
+    memset(&ee, 0, sizeof(ee) );
+    ee.events = (events & EV_READ ? EPOLLIN : 0)
+        | (events & EV_WRITE ? EPOLLOUT : 0)
+        | (events & EV_EDGE ? EPOLLET : 0);
+    ee.data.ptr = data;
+    if (epoll_ctl(ev.epfd, op, fd, &ee) < 0) {
+        fatal_sys("epoll_ctl: fd %d", fd);
+    }
+}
+#else
+int
+ev_find(int fd)
+{
+    int i;
+
+    for (i = 0; i < ev.nregs; ++i) {
+        if (ev.regs[i].fd == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+#endif
+
+void
+ev_add(int fd, int events, void *data)
+{
+#if defined(EV_EPOLL)
+    ev_ctl(EPOLL_CTL_ADD, fd, events, data);
+#else
+    if (ev.nregs == ev.nalloc) {
+        ev.nalloc = ev.nalloc ? 2 * ev.nalloc : 16;
+        ev.regs = realloc(ev.regs, ev.nalloc * sizeof(struct ev_event) );
+        if (ev.regs == NULL) {
+            fatal_sys("realloc");
+        }
+#if defined(EV_POLL)
+        ev.pfds = realloc(ev.pfds, ev.nalloc * sizeof(struct pollfd) );
+        if (ev.pfds == NULL) {
+            fatal_sys("realloc");
+        }
+#endif
+    }
+#if defined(EV_SELECT)
+    if (fd >= FD_SETSIZE) {
+        fatal(ERROR_GENERAL, "fd %d is too large for select()", fd);
+    }
+#endif
+    ev.regs[ev.nregs].fd = fd;
+    ev.regs[ev.nregs].events = events;
+    ev.regs[ev.nregs].data = data;
+    ++ev.nregs;
+#endif
+}
+
+void
+ev_mod(int fd, int events, void *data)
+{
+#if defined(EV_EPOLL)
+    ev_ctl(EPOLL_CTL_MOD, fd, events, data);
+#else
+    int i;
+
+    if ((i = ev_find(fd) ) >= 0) {
+        ev.regs[i].events = events;
+        ev.regs[i].data = data;
+    }
+#endif
+}
+
+/*
+ * Must be called before close(fd).
+ */
+void
+ev_del(int fd)
+{
+#if defined(EV_EPOLL)
+    epoll_ctl(ev.epfd, EPOLL_CTL_DEL, fd, NULL);
+#else
+    int i;
+
+    if ((i = ev_find(fd) ) >= 0) {
+        ev.regs[i] = ev.regs[--ev.nregs];
+    }
+#endif
+}
+
+/*
+ * Wait at most `timeout' ms (-1 means forever) for the registered fds.
+ * Returns the number of events, or -1 with errno set (e.g. EINTR).
+ */
+int
+ev_wait(struct ev_event *events, int maxevents, int timeout)
+{
+    int i, n = 0;
+#if defined(EV_EPOLL)
+    struct epoll_event ees[EV_MAXEVENTS];
+
+    if (maxevents > EV_MAXEVENTS) {
+        maxevents = EV_MAXEVENTS;
+    }
+    if ((n = epoll_wait(ev.epfd, ees, maxevents, timeout) ) <= 0) {
+        return n;
+    }
+    for (i = 0; i < n; ++i) {
+        events[i].fd = -1;
+        events[i].data = ees[i].data.ptr;
+        events[i].events = 0;
+        if (ees[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) ) {
+            events[i].events |= EV_READ;
+        }
+        if (ees[i].events & (EPOLLOUT | EPOLLERR) ) {
+            events[i].events |= EV_WRITE;
+        }
+    }
+#elif defined(EV_POLL)
+    int r;
+
+    for (i = 0; i < ev.nregs; ++i) {
+        ev.pfds[i].fd = ev.regs[i].fd;
+        ev.pfds[i].events = (ev.regs[i].events & EV_READ ? POLLIN : 0)
+            | (ev.regs[i].events & EV_WRITE ? POLLOUT : 0);
+        ev.pfds[i].revents = 0;
+    }
+    if ((r = poll(ev.pfds, ev.nregs, timeout) ) <= 0) {
+        return r;
+    }
+    for (i = 0; i < ev.nregs && n < maxevents; ++i) {
+        if (ev.pfds[i].revents == 0) {
+            continue;
+        }
+        events[n].fd = ev.regs[i].fd;
+        events[n].data = ev.regs[i].data;
+        events[n].events = 0;
+        if (ev.pfds[i].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL) ) {
+            events[n].events |= EV_READ;
+        }
+        if (ev.pfds[i].revents & (POLLOUT | POLLERR) ) {
+            events[n].events |= EV_WRITE;
+        }
+        ++n;
+    }
+#else
+    fd_set readfds, writefds;
+    struct timeval tv;
+    int r, maxfd = -1;
+
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    for (i = 0; i < ev.nregs; ++i) {
+        if (ev.regs[i].events & EV_READ) {
+            FD_SET(ev.regs[i].fd, &readfds);
+        }
+        if (ev.regs[i].events & EV_WRITE) {
+            FD_SET(ev.regs[i].fd, &writefds);
+        }
+        if (ev.regs[i].fd > maxfd) {
+            maxfd = ev.regs[i].fd;
+        }
+    }
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = timeout % 1000 * 1000;
+    r = select(maxfd + 1, &readfds, &writefds, NULL, timeout < 0 ? NULL : &tv);
+    if (r <= 0) {
+        return r;
+    }
+    for (i = 0; i < ev.nregs && n < maxevents; ++i) {
+        events[n].events = 0;
+        if (FD_ISSET(ev.regs[i].fd, &readfds) ) {
+            events[n].events |= EV_READ;
+        }
+        if (FD_ISSET(ev.regs[i].fd, &writefds) ) {
+            events[n].events |= EV_WRITE;
+        }
+        if (events[n].events != 0) {
+            events[n].fd = ev.regs[i].fd;
+            events[n].data = ev.regs[i].data;
+            ++n;
+        }
+    }
+#endif
+    return n;
+}
+
+/*
+ * Timers, in a binary heap ordered by expiry. big_loop() sleeps in
+ * ev_wait() exactly until the first one is due, so there's no periodic
+ * wakeup. (A timerfd would add a syscall per rearm and buy nothing since
+ * the wait timeout is already in ms.)
+ */
+static struct {
+    struct timer **heap;
+    int n;
+    int nalloc;
+} tm;
+
+int64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void
+timer_init(struct timer *t, void (*fn)(struct timer *), void *arg)
+{
+    t->index = -1;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+void
+timer_swap(int i, int j)
+{
+    struct timer *t = tm.heap[i];
+
+    tm.heap[i] = tm.heap[j];
+    tm.heap[j] = t;
+    tm.heap[i]->index = i;
+    tm.heap[j]->index = j;
+}
+
+/*
+ * Restore the heap order after heap[i] changed.
+ */
+void
+timer_fix(int i)
+{
+    int child;
+
+    while (i > 0 && tm.heap[i]->when < tm.heap[(i - 1) / 2]->when) {
+        timer_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while ((child = 2 * i + 1) < tm.n) {
+        if (child + 1 < tm.n && tm.heap[child + 1]->when < tm.heap[child]->when) {
+            ++child;
+        }
+        if (tm.heap[i]->when <= tm.heap[child]->when) {
+            break;
+        }
+        timer_swap(i, child);
+        i = child;
+    }
+}
+
+void
+timer_cancel(struct timer *t)
+{
+    int i = t->index;
+
+    if (i < 0) {
+        return;
+    }
+    t->index = -1;
+    if (i != --tm.n) {
+        tm.heap[i] = tm.heap[tm.n];
+        tm.heap[i]->index = i;
+        timer_fix(i);
+    }
+}
+
+/*
+ * (Re)arm `t' to fire in `ms' milliseconds.
+ */
+void
+timer_set(struct timer *t, int ms)
+{
+    t->when = now_ms() + ms;
+    if (t->index >= 0) {
+        timer_fix(t->index);
+        return;
+    }
+
+    if (tm.n == tm.nalloc) {
+        tm.nalloc = tm.nalloc ? 2 * tm.nalloc : 16;
+        tm.heap = realloc(tm.heap, tm.nalloc * sizeof(struct timer *) );
+        if (tm.heap == NULL) {
+            fatal_sys("realloc");
+        }
+    }
+    t->index = tm.n;
+    tm.heap[tm.n++] = t;
+    timer_fix(t->index);
+}
+
+/*
+ * The ev_wait() timeout till the first timer is due, -1 if none.
+ */
+int
+timer_timeout(void)
+{
+    int64_t ms;
+
+    if (tm.n == 0) {
+        return -1;
+    }
+    ms = tm.heap[0]->when - now_ms();
+    return ms < 0 ? 0 : ms > INT_MAX ? INT_MAX : (int) ms;
+}
+
+/*
+ * Fire the timers which are due. They may rearm themselves.
+ */
+void
+timer_run(void)
+{
+    int64_t now = now_ms();
+    struct timer *t;
+
+    while (tm.n > 0 && tm.heap[0]->when <= now) {
+        t = tm.heap[0];
+        timer_cancel(t);
+        t->fn(t);
+    }
+}
+
+/*
+ * Wait for a single fd outside of the event loop. Returns true if it's ready.
+ */
+bool
+fd_wait(int fd, int events, int timeout)
+{
+#if defined(EV_SELECT)
+    fd_set fds;
+    struct timeval tv;
+
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = timeout % 1000 * 1000;
+
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    if (events & EV_WRITE) {
+        return select(fd + 1, NULL, &fds, NULL, timeout < 0 ? NULL : &tv) > 0;
+    } else {
+        return select(fd + 1, &fds, NULL, NULL, timeout < 0 ? NULL : &tv) > 0;
+    }
+#else
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = (events & EV_READ ? POLLIN : 0) | (events & EV_WRITE ? POLLOUT : 0);
+    pfd.revents = 0;
+    return poll(&pfd, 1, timeout) > 0;
+#endif
+}
+
+ssize_t
+writen(int fd, const void *ptr, size_t n)
+{
+    size_t nleft;
+    ssize_t nwritten;
+
+    nleft = n;
+    while (nleft > 0) {
+        if ((nwritten = write(fd, ptr, nleft)) < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                /* stderr may share a non-blocking stdout, see out_open() */
+                fd_wait(fd, EV_WRITE, -1);
+                continue;
+            }
+            if (nleft == n) {
+                return (-1);
+            } else {
+                /* error, return amount written so far */
+                break;
+            }
+        } else if (nwritten == 0) {
+            break;
+        }
+        nleft -= nwritten;
+        ptr += nwritten;
+    }
+    return (n - nleft);
+}
+
+/*
+ * The only portable use of signal() is to set a signal's disposition
+ * to SIG_DFL or SIG_IGN.  The semantics when using signal() to
+ * establish a signal handler vary across systems (and POSIX.1
+ * explicitly  permits  this variation); do not use it for this purpose.
+ *
+ * POSIX.1 solved the portability mess by specifying sigaction(2),
+ * which provides explicit control of the semantics when a signal
+ * handler is invoked; use that interface instead of signal().
+ *
+ * In the original UNIX systems, when a handler that was established
+ * using signal() was invoked by the delivery of a signal, the
+ * disposition of the signal would be reset to SIG_DFL, and the system
+ * did not block delivery of further instances of the signal.  This is
+ * equivalent to calling sigaction(2) with the following flags:
+ *
+ *   sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+ */
+void
+sig_handle(int signo, void (*handler)(int) )
+{
+    struct sigaction act;
+
+    memset(&act, 0, sizeof(act) );
+    act.sa_handler = handler;
+    sigaction(signo, &act, NULL);
+}
+
+/*
+ * Signals are turned into events on g.fd_signal so the event loop notices
+ * them right away: signalfd on Linux, the self-pipe trick elsewhere.
+ */
+#if !defined(__linux__)
+void
+sig_pipe(int signo)
+{
+    int error = errno;
+    unsigned char c = signo;
+
+    write(g.sig_pipe[1], &c, 1);
+    errno = error;
+}
+#endif
+
+void
+sig_init(void)
+{
+#if defined(__linux__)
+    sigemptyset(&g.sigmask);
+    g.fd_signal = signalfd(-1, &g.sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (g.fd_signal < 0) {
+        fatal_sys("signalfd error");
+    }
+#else
+    int i;
+
+    if (pipe(g.sig_pipe) < 0) {
+        fatal_sys("pipe error");
+    }
+    for (i = 0; i < 2; ++i) {
+        fcntl(g.sig_pipe[i], F_SETFL, fcntl(g.sig_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(g.sig_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    g.fd_signal = g.sig_pipe[0];
+#endif
+    sigprocmask(SIG_SETMASK, NULL, &g.orig_sigmask);
+
+    ev_add(g.fd_signal, EV_READ | EV_EDGE, &g.fd_signal);
+}
+
+/*
+ * Start delivering `signo' to g.fd_signal.
+ */
+void
+sig_watch(int signo)
+{
+#if defined(__linux__)
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, signo);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    sigaddset(&g.sigmask, signo);
+    if (signalfd(g.fd_signal, &g.sigmask, 0) < 0) {
+        fatal_sys("signalfd error");
+    }
+#else
+    sig_handle(signo, sig_pipe);
+#endif
+}
+
+/*
+ * Listen on the UNIX socket `path', only for our own uid.
+ */
+int
+unix_listen(char *path)
+{
+    struct sockaddr_un addr;
+    mode_t mask;
+    int fd;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        fatal_sys("socket");
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    /* not for the children (--control) */
+    mask = umask(077);
+    unlink(path);
+    if (bind(fd, (const struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fatal_sys("failed to bind %s", path);
+    }
+    umask(mask);
+    if (listen(fd, SOMAXCONN) < 0) {
+        fatal_sys("listen");
+    }
+    return fd;
+}
+
+/*
+ * The pty pool (--pty-server and --pty-pool).
+ *
+ * The server keeps --pty-pool-size pty pairs allocated, with the slave
+ * already opened, and passes one pair to every client connecting to its
+ * socket (SCM_RIGHTS). The pool is refilled only when no client is
+ * waiting, so under a burst of clients allocating ptys is not on their
+ * critical path.
+ */
+
+/*
+ * Allocate a pty pair for the pool. The slave is opened without becoming
+ * our controlling terminal.
+ */
+int
+pty_pool_open(int *fds)
+{
+    char pts_name[32];
+    int fdm;
+
+    if ((fdm = ptym_open(pts_name, sizeof(pts_name))) < 0)
+        fatal_sys("can't open master pty: %s, error %d", pts_name, fdm);
+    if ((*fds = open(pts_name, O_RDWR | O_NOCTTY)) < 0)
+        fatal_sys("can't open slave pty");
+    return fdm;
+}
+
+bool
+pty_pool_send(int fd, int fdm, int fds)
+{
+    char dummy = 0, cbuf[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { &dummy, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int pair[2] = { fdm, fds };
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(pair));
+    memcpy(CMSG_DATA(cmsg), pair, sizeof(pair));
+
+    return sendmsg(fd, &msg, 0) == 1;
+}
+
+/*
+ * Get a pty pair from the server at `path'. Returns the master, or -1 if
+ * the caller has to allocate one itself.
+ */
+int
+pty_pool_take(char *path, int *fds, char *pts_name, int pts_namesz)
+{
+    char dummy, cbuf[CMSG_SPACE(2 * sizeof(int))], *ptr;
+    struct iovec iov = { &dummy, 1 };
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fd, pair[2];
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    if (connect(fd, (const struct sockaddr *) &addr, sizeof(addr)) < 0
+        || recvmsg(fd, &msg, 0) != 1
+        || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL
+        || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(pair))) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    memcpy(pair, CMSG_DATA(cmsg), sizeof(pair));
+
+    if ((ptr = ptsname(pair[0])) == NULL) {
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    snprintf(pts_name, pts_namesz, "%s", ptr);
+    fcntl(pair[1], F_SETFD, FD_CLOEXEC);
+
+    *fds = pair[1];
+    return pair[0];
+}
+
+void
+pty_server(char *path)
+{
+    int (*pool)[2];
+    int fd, conn, npool = 0;
+
+    if ((pool = calloc(g.opt.pty_pool_size, sizeof(*pool))) == NULL) {
+        fatal_sys("calloc");
+    }
+
+    fd = unix_listen(path);
+    sig_handle(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+        if (npool < g.opt.pty_pool_size && ! fd_wait(fd, EV_READ, 0) ) {
+            pool[npool][0] = pty_pool_open(&pool[npool][1]);
+            ++npool;
+            continue;
+        }
+
+        if ((conn = accept(fd, NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            fatal_sys("accept");
+        }
+        if (npool == 0) {
+            pool[0][0] = pty_pool_open(&pool[0][1]);
+            npool = 1;
+        }
+        /* keep the pair if the client's gone */
+        if (pty_pool_send(conn, pool[npool - 1][0], pool[npool - 1][1]) ) {
+            --npool;
+            close(pool[npool][0]);
+            close(pool[npool][1]);
+        }
+        close(conn);
+    }
+}
+
+/*
+ * The credential agent (--agent).
+ *
+ * A password is fetched by running the --agent-fetch command (with the key
+ * as `$1') the first time it's asked for, and then served from memory till
+ * it's --agent-ttl seconds old. Secrets are kept in one mlock()ed arena so
+ * they never hit the swap. The protocol is one request per connection:
+ *
+ *   -> <key>\n
+ *   <- +<password>\n    or    -<error>\n
+ *
+ * Clients asking for a key being fetched wait for the same fetch. A fetch
+ * taking more than AGENT_FETCH_TIMEOUT ms is killed and they get `-timeout'.
+ * It's over once its stdout is closed and it's been reaped on SIGCHLD, so
+ * the agent never waits for it.
+ */
+struct agent_client {
+    int fd;
+    char req[AGENT_KEY_MAX + 1];
+    int len;
+    struct agent_client *next;  /* waiting for the same slot */
+};
+
+struct agent_slot {
+    char key[AGENT_KEY_MAX];    /* empty if the slot is free */
+    char *secret;               /* AGENT_SECRET_MAX bytes in the arena */
+    int len;
+    bool ready;
+    pid_t pid;                  /* the fetch command, 0 if not running */
+    int fd;                     /* its stdout, -1 once closed */
+    bool exited;                /* it's been reaped */
+    int status;
+    const char *err;            /* why it was killed */
+    int64_t used;               /* for replacing the least recently used */
+    struct timer t_expire;
+    struct timer t_fetch;       /* AGENT_FETCH_TIMEOUT */
+    struct agent_client *waiting;
+};
+
+static struct {
+    int fd;                     /* listening */
+    char *arena;
+    struct agent_slot slots[AGENT_SLOTS];
+} ag;
+
+void
+agent_reply(struct agent_client *c, char status, const char *msg, int len)
+{
+    struct iovec iov[3];
+
+    iov[0].iov_base = &status;
+    iov[0].iov_len = 1;
+    iov[1].iov_base = (char *) msg;
+    iov[1].iov_len = len;
+    iov[2].iov_base = "\n";
+    iov[2].iov_len = 1;
+    /* a fresh socket always has room for it, or the client's gone */
+    writev(c->fd, iov, 3);
+
+    close(c->fd);
+    free(c);
+}
+
+void
+agent_clear(struct agent_slot *s)
+{
+    memset(s->secret, 0, AGENT_SECRET_MAX);
+    s->len = 0;
+    s->key[0] = '\0';
+    s->ready = false;
+    timer_cancel(&s->t_expire);
+}
+
+void
+agent_expire(struct timer *t)
+{
+    agent_clear(t->arg);
+}
+
+void
+agent_fetch(struct agent_slot *s)
+{
+    int fds[2], null;
+
+    if (pipe(fds) < 0) {
+        fatal_sys("pipe");
+    }
+    if ((s->pid = fork()) < 0) {
+        fatal_sys("fork");
+    } else if (s->pid == 0) {
+        /* a group of its own, so all of it can be killed on timeout */
+        setpgid(0, 0);
+        if ((null = open("/dev/null", O_RDONLY)) >= 0) {
+            dup2(null, STDIN_FILENO);
+        }
+        dup2(fds[1], STDOUT_FILENO);
+        sigprocmask(SIG_SETMASK, &g.orig_sigmask, NULL);
+        sig_handle(SIGPIPE, SIG_DFL);
+        execl("/bin/sh", "sh", "-c", g.opt.agent_fetch, MY_NAME, s->key, (char *) NULL);
+        _exit(127);
+    }
+    setpgid(s->pid, s->pid);
+    s->exited = false;
+    s->err = NULL;
+    close(fds[1]);
+    s->fd = fds[0];
+    fcntl(s->fd, F_SETFD, FD_CLOEXEC);
+    ev_add(s->fd, EV_READ, s);
+    timer_set(&s->t_fetch, AGENT_FETCH_TIMEOUT);
+}
+
+/*
+ * Reply to those waiting for the fetch once it's over.
+ */
+void
+agent_fetch_done(struct agent_slot *s)
+{
+    struct agent_client *c, *next;
+    const char *err = s->err;
+
+    if (s->fd >= 0 || ! s->exited) {
+        return;
+    }
+    timer_cancel(&s->t_fetch);
+    s->pid = 0;
+
+    if (err == NULL && (! WIFEXITED(s->status) || WEXITSTATUS(s->status) != 0) ) {
+        err = "fetch command failed";
+    }
+    /* only the first line */
+    if (err == NULL) {
+        s->len = strcspn(s->secret, "\r\n");
+        memset(s->secret + s->len, 0, AGENT_SECRET_MAX - s->len);
+        s->ready = true;
+        timer_set(&s->t_expire, g.opt.agent_ttl * 1000);
+    }
+
+    for (c = s->waiting; c != NULL; c = next) {
+        next = c->next;
+        if (err == NULL) {
+            agent_reply(c, '+', s->secret, s->len);
+        } else {
+            agent_reply(c, '-', err, strlen(err) );
+        }
+    }
+    s->waiting = NULL;
+    if (err != NULL) {
+        agent_clear(s);
+    }
+}
+
+void
+agent_fetch_close(struct agent_slot *s)
+{
+    if (s->fd >= 0) {
+        ev_del(s->fd);
+        close(s->fd);
+        s->fd = -1;
+    }
+    agent_fetch_done(s);
+}
+
+/*
+ * Kill the whole group: what's left of it is reaped on SIGCHLD.
+ */
+void
+agent_fetch_kill(struct agent_slot *s, const char *err)
+{
+    kill(-s->pid, SIGKILL);
+    s->err = err;
+    agent_fetch_close(s);
+}
+
+void
+agent_fetch_timeout(struct timer *t)
+{
+    agent_fetch_kill(t->arg, "timeout");
+}
+
+/*
+ * Output of a fetch command. It's read right into the arena.
+ */
+void
+agent_fetched(struct agent_slot *s)
+{
+    int nread;
+
+    nread = read(s->fd, s->secret + s->len, AGENT_SECRET_MAX - s->len);
+    if (nread < 0 && (errno == EINTR || errno == EAGAIN) ) {
+        return;
+    } else if (nread > 0) {
+        s->len += nread;
+        if (s->len == AGENT_SECRET_MAX) {
+            agent_fetch_kill(s, "password too long");
+        }
+        return;
+    }
+    agent_fetch_close(s);
+}
+
+/*
+ * SIGCHLD: reap the fetch commands which are done, without waiting.
+ */
+void
+agent_reap(void)
+{
+    struct agent_slot *s;
+    pid_t pid;
+    int i;
+
+    for (i = 0; i < AGENT_SLOTS; ++i) {
+        s = &ag.slots[i];
+        if (s->pid == 0 || s->exited) {
+            continue;
+        }
+        while ((pid = waitpid(s->pid, &s->status, WNOHANG) ) < 0 && errno == EINTR)
+            ;
+        if (pid == s->pid) {
+            s->exited = true;
+            agent_fetch_done(s);
+        }
+    }
+}
+
+void
+agent_request(struct agent_client *c)
+{
+    struct agent_slot *s, *lru = NULL;
+    int i;
+
+    for (i = 0; i < AGENT_SLOTS; ++i) {
+        s = &ag.slots[i];
+        if (strcmp(s->key, c->req) == 0) {
+            break;
+        }
+        /* a free slot, or the least recently used one not being fetched */
+        if (s->pid == 0 && (lru == NULL
+                            || (lru->key[0] != '\0'
+                                && (s->key[0] == '\0' || s->used < lru->used) ))) {
+            lru = s;
+        }
+    }
+
+    if (i == AGENT_SLOTS) {
+        if ((s = lru) == NULL) {
+            agent_reply(c, '-', "busy", 4);
+            return;
+        }
+        agent_clear(s);
+        strcpy(s->key, c->req);
+        agent_fetch(s);
+    }
+    s->used = now_ms();
+
+    if (s->ready) {
+        agent_reply(c, '+', s->secret, s->len);
+    } else {
+        c->next = s->waiting;
+        s->waiting = c;
+    }
+}
+
+/*
+ * Once a request has been read the client is not watched any more, so no
+ * event for it is left in the batch being handled when it's replied to
+ * (and freed).
+ */
+void
+agent_read(struct agent_client *c)
+{
+    char *nl;
+    int nread;
+
+    nread = read(c->fd, c->req + c->len, AGENT_KEY_MAX - c->len);
+    if (nread < 0 && (errno == EINTR || errno == EAGAIN) ) {
+        return;
+    }
+    if (nread <= 0) {
+        ev_del(c->fd);
+        close(c->fd);
+        free(c);
+        return;
+    }
+    c->len += nread;
+    c->req[c->len] = '\0';
+
+    if ((nl = strchr(c->req, '\n')) != NULL) {
+        *nl = '\0';
+        ev_del(c->fd);
+        if (c->req[0] == '\0') {
+            agent_reply(c, '-', "empty key", 9);
+        } else {
+            agent_request(c);
+        }
+    } else if (c->len == AGENT_KEY_MAX) {
+        ev_del(c->fd);
+        agent_reply(c, '-', "key too long", 12);
+    }
+}
+
+void sig_read(bool *chld, bool *winch);
+
+void
+agent_run(char *path)
+{
+    struct ev_event events[EV_MAXEVENTS];
+    struct agent_client *c;
+    bool chld, winch;
+    int i, n, fd;
+
+    /*
+     * One arena for all the secrets, locked in memory and kept out of
+     * core dumps.
+     */
+    ag.arena = mmap(NULL, AGENT_SLOTS * AGENT_SECRET_MAX, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (ag.arena == MAP_FAILED) {
+        fatal_sys("mmap");
+    }
+    if (mlock(ag.arena, AGENT_SLOTS * AGENT_SECRET_MAX) < 0) {
+        fprintf(stderr, "!! mlock: %s, passwords may be swapped out\r\n", strerror(errno) );
+    }
+#if defined(MADV_DONTDUMP)
+    madvise(ag.arena, AGENT_SLOTS * AGENT_SECRET_MAX, MADV_DONTDUMP);
+#endif
+    for (i = 0; i < AGENT_SLOTS; ++i) {
+        ag.slots[i].secret = ag.arena + i * AGENT_SECRET_MAX;
+        ag.slots[i].fd = -1;
+        timer_init(&ag.slots[i].t_expire, agent_expire, &ag.slots[i]);
+        timer_init(&ag.slots[i].t_fetch, agent_fetch_timeout, &ag.slots[i]);
+    }
+
+    ag.fd = unix_listen(path);
+    fcntl(ag.fd, F_SETFL, fcntl(ag.fd, F_GETFL) | O_NONBLOCK);
+    sig_handle(SIGPIPE, SIG_IGN);
+
+    ev_init();
+    ev_add(ag.fd, EV_READ, &ag.fd);
+    sig_init();
+    sig_watch(SIGCHLD);
+
+    while (true) {
+        timer_run();
+        n = ev_wait(events, EV_MAXEVENTS, timer_timeout() );
+        if (n < 0 && errno != EINTR) {
+            fatal_sys("ev_wait");
+        }
+        for (i = 0; i < n; ++i) {
+            if (events[i].data == &g.fd_signal) {
+                chld = false;
+                sig_read(&chld, &winch);
+                if (chld) {
+                    agent_reap();
+                }
+            } else if (events[i].data == &ag.fd) {
+                while ((fd = accept(ag.fd, NULL, NULL)) >= 0) {
+                    if ((c = calloc(1, sizeof(*c))) == NULL) {
+                        fatal_sys("calloc");
+                    }
+                    c->fd = fd;
+                    fcntl(fd, F_SETFD, FD_CLOEXEC);
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    ev_add(fd, EV_READ, c);
+                }
+            } else if ((struct agent_slot *) events[i].data >= ag.slots
+                       && (struct agent_slot *) events[i].data < ag.slots + AGENT_SLOTS) {
+                agent_fetched(events[i].data);
+            } else {
+                agent_read(events[i].data);
+            }
+        }
+    }
+}
+
+/*
+ * Ask the agent for the password of a session (`-p agent:'). The request
+ * is handled by the event loop like the ptys, so a slow --agent-fetch only
+ * holds up the sessions waiting for it, and for -t at most (AGENT_TIMEOUT
+ * without -t). password_answer() is called when the password is back.
+ */
+struct agent_req {
+    int fd;
+    struct session *s;
+    int rule;                   /* the prompt, -1 for --control */
+    bool sent;                  /* else it's still connecting */
+    char req[AGENT_KEY_MAX + 1];
+    int reqlen;
+    char buf[AGENT_SECRET_MAX + 2];
+    int len;
+    struct timer t_timeout;
+    struct agent_req *next;
+};
+
+static struct agent_req *agent_reqs;
+
+void session_fatal(struct session *s, int rcode, const char *fmt, ...);
+void password_answer(struct session *s, int i);
+
+void
+agent_req_free(struct agent_req *r)
+{
+    struct agent_req **pp;
+
+    for (pp = &agent_reqs; *pp != r; pp = &(*pp)->next)
+        ;
+    *pp = r->next;
+    r->s->agent = NULL;
+
+    ev_del(r->fd);
+    close(r->fd);
+    timer_cancel(&r->t_timeout);
+    memset(r->buf, 0, sizeof(r->buf) );
+    free(r);
+}
+
+void
+agent_fail(struct agent_req *r, int rcode, const char *err)
+{
+    struct session *s = r->s;
+    char msg[AGENT_SECRET_MAX + 2];
+
+    /* `err' may be in r->buf */
+    snprintf(msg, sizeof(msg), "%s", err);
+    agent_req_free(r);
+    session_fatal(s, rcode, "agent: %s", msg);
+}
+
+void
+agent_timeout(struct timer *t)
+{
+    agent_fail(t->arg, ERROR_TIMEOUT, "timed out");
+}
+
+void
+agent_ask(struct session *s, int rule)
+{
+    struct sockaddr_un addr;
+    struct agent_req *r;
+    char *key;
+    int n;
+
+    if (s->agent != NULL) {
+        return;
+    }
+    if (! g.fleet || (key = str_replace(g.opt.agent_key, "{}", s->label)) == NULL) {
+        key = g.opt.agent_key;
+    }
+    if ((r = calloc(1, sizeof(*r) ) ) == NULL) {
+        fatal_sys("calloc");
+    }
+    n = snprintf(r->req, sizeof(r->req), "%s\n", key);
+    if (key != g.opt.agent_key) {
+        free(key);
+    }
+    r->reqlen = n < sizeof(r->req) ? n : sizeof(r->req) - 1;
+    r->s = s;
+    r->rule = rule;
+    if ((r->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        fatal_sys("socket");
+    }
+    fcntl(r->fd, F_SETFD, FD_CLOEXEC);
+    fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) | O_NONBLOCK);
+    r->next = agent_reqs;
+    agent_reqs = r;
+    s->agent = r;
+    timer_init(&r->t_timeout, agent_timeout, r);
+    timer_set(&r->t_timeout, g.opt.timeout != 0 ? g.opt.timeout : AGENT_TIMEOUT);
+
+    /* the request goes once it's connected, see agent_io() */
+    ev_add(r->fd, EV_WRITE, r);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, g.opt.agent_sock, sizeof(addr.sun_path) - 1);
+    if (connect(r->fd, (const struct sockaddr *) &addr, sizeof(addr)) < 0
+        && errno != EINPROGRESS) {
+        agent_fail(r, ERROR_GENERAL, strerror(errno) );
+    }
+}
+
+void
+agent_io(struct agent_req *r)
+{
+    struct session *s = r->s;
+    socklen_t errlen = sizeof(int);
+    int err = 0, nread, rule = r->rule;
+    char *nl;
+
+    if (! r->sent) {
+        if (getsockopt(r->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) {
+            err = errno;
+        }
+        /* a fresh socket always has room for it */
+        if (err == 0 && write(r->fd, r->req, r->reqlen) != r->reqlen) {
+            err = errno;
+        }
+        if (err != 0) {
+            agent_fail(r, ERROR_GENERAL, strerror(err) );
+            return;
+        }
+        r->sent = true;
+        ev_mod(r->fd, EV_READ, r);
+        return;
+    }
+
+    nread = read(r->fd, r->buf + r->len, sizeof(r->buf) - 1 - r->len);
+    if (nread < 0 && (errno == EINTR || errno == EAGAIN) ) {
+        return;
+    } else if (nread > 0) {
+        r->len += nread;
+        r->buf[r->len] = '\0';
+        if (strchr(r->buf, '\n') == NULL && r->len < sizeof(r->buf) - 1) {
+            return;
+        }
+    }
+
+    if ((nl = strchr(r->buf, '\n')) == NULL) {
+        agent_fail(r, ERROR_GENERAL, "bad reply");
+        return;
+    }
+    *nl = '\0';
+    if (r->buf[0] != '+') {
+        agent_fail(r, ERROR_GENERAL, r->buf + 1);
+        return;
+    }
+    if ((s->password = strdup(r->buf + 1)) == NULL) {
+        fatal_sys("strdup");
+    }
+    agent_req_free(r);
+    password_answer(s, rule);
+}
+
+/*
+ * Whether `data' of an event is an agent request (and handle it).
+ */
+bool
+agent_event(void *data)
+{
+    struct agent_req *r;
+
+    for (r = agent_reqs; r != NULL; r = r->next) {
+        if (r == data) {
+            agent_io(r);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * The -l/-L logs are written by a thread of their own, so logging costs
+ * the event loop a memcpy() into a ring buffer (one per log) and a slow
+ * disk does not hold up the sessions. The thread writes whatever is in
+ * the rings with one writev() per log and fdatasync()s them as -S says.
+ * When a ring is full -B decides: `block' waits for the thread, `drop'
+ * discards the data (and counts it) and `fail' exits.
+ */
+static struct {
+    pthread_t tid;
+    bool running;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        /* data for the thread, or stop */
+    pthread_cond_t space;       /* room in the rings for log_put() */
+    atomic_bool idle;           /* the thread is waiting on `wake' */
+    atomic_bool waiting;        /* log_put() is waiting on `space' */
+    atomic_bool stop;
+} lg = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .space = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * Write out what's in the ring. Returns the number of bytes written.
+ */
+size_t
+log_flush(struct outq *q)
+{
+    struct logring *r = &q->ring;
+    size_t head, tail, off, n;
+    struct iovec iov[2];
+    ssize_t nw;
+    int cnt;
+
+    head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head == tail) {
+        return 0;
+    }
+
+    off = head & (r->size - 1);
+    n = tail - head;
+    iov[0].iov_base = r->buf + off;
+    if (off + n <= r->size) {
+        iov[0].iov_len = n;
+        cnt = 1;
+    } else {
+        iov[0].iov_len = r->size - off;
+        iov[1].iov_base = r->buf;
+        iov[1].iov_len = n - iov[0].iov_len;
+        cnt = 2;
+    }
+
+    if ((nw = writev(q->fd, iov, cnt) ) < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return 0;
+        }
+        /* reported by log_put(), the data is thrown away */
+        atomic_store(&r->err, errno);
+        nw = n;
+    } else {
+        atomic_fetch_add(&r->logged, nw);
+    }
+    atomic_store(&r->head, head + nw);
+    return nw;
+}
+
+void *
+log_thread(void *arg)
+{
+    struct timespec ts;
+    time_t last_sync = time(NULL);
+    bool dirty = false, empty;
+    size_t n;
+    int i;
+
+    while (true) {
+        for (n = 0, i = 0; i < NOUTS; ++i) {
+            if (g.out[i].log) {
+                n += log_flush(&g.out[i]);
+            }
+        }
+        if (n > 0) {
+            dirty = true;
+            if (atomic_load(&lg.waiting) ) {
+                pthread_mutex_lock(&lg.lock);
+                pthread_cond_signal(&lg.space);
+                pthread_mutex_unlock(&lg.lock);
+            }
+        }
+
+        if (dirty && g.opt.log_sync >= 0
+            && labs(time(NULL) - last_sync) >= g.opt.log_sync) {
+            for (i = 0; i < NOUTS; ++i) {
+                if (g.out[i].log) {
+                    fdatasync(g.out[i].fd);
+                }
+            }
+            last_sync = time(NULL);
+            dirty = false;
+        }
+        if (n > 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&lg.lock);
+        atomic_store(&lg.idle, true);
+        empty = true;
+        for (i = 0; i < NOUTS; ++i) {
+            if (g.out[i].log && atomic_load(&g.out[i].ring.head)
+                != atomic_load(&g.out[i].ring.tail) ) {
+                empty = false;
+            }
+        }
+        if (empty && atomic_load(&lg.stop) ) {
+            pthread_mutex_unlock(&lg.lock);
+            break;
+        }
+        if (empty) {
+            /* wake up now and then for -S */
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&lg.wake, &lg.lock, &ts);
+        }
+        atomic_store(&lg.idle, false);
+        pthread_mutex_unlock(&lg.lock);
+    }
+
+    if (g.opt.log_sync >= 0) {
+        for (i = 0; i < NOUTS; ++i) {
+            if (g.out[i].log) {
+                fdatasync(g.out[i].fd);
+            }
+        }
+    }
+    return arg;
+}
+
+void
+log_open(int i, int fd, const char *name)
+{
+    struct outq *q = &g.out[i];
+    struct logring *r = &q->ring;
+
+    q->name = name;
+    q->fd = fd;
+    q->log = true;
+
+    r->size = RELAY_BUFFSIZE;
+    while (r->size < g.opt.hiwat) {
+        r->size *= 2;
+    }
+    if ((r->buf = malloc(r->size) ) == NULL) {
+        fatal_sys("malloc");
+    }
+}
+
+void
+log_start(void)
+{
+    sigset_t all, old;
+    int i, err;
+
+    for (i = 0; i < NOUTS; ++i) {
+        if (g.out[i].log) {
+            break;
+        }
+    }
+    if (i == NOUTS) {
+        return;
+    }
+
+    /* signals are for the event loop only */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&lg.tid, NULL, log_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        errno = err;
+        fatal_sys("pthread_create");
+    }
+    lg.running = true;
+}
+
+/*
+ * Let the thread write out everything and wait for it.
+ */
+void
+log_stop(void)
+{
+    int i;
+
+    if (! lg.running) {
+        return;
+    }
+    lg.running = false;
+
+    pthread_mutex_lock(&lg.lock);
+    atomic_store(&lg.stop, true);
+    pthread_cond_signal(&lg.wake);
+    pthread_mutex_unlock(&lg.lock);
+    pthread_join(lg.tid, NULL);
+
+    for (i = 0; i < NOUTS; ++i) {
+        if (g.out[i].log && g.out[i].ring.dropped > 0) {
+            fprintf(stderr, "!! %s: dropped %llu bytes (%llu bytes logged)\r\n",
+                    g.out[i].name, g.out[i].ring.dropped,
+                    (unsigned long long) atomic_load(&g.out[i].ring.logged) );
+        }
+    }
+}
+
+/*
+ * Copy data into the ring of a log. Called only from the event loop.
+ */
+void
+log_put(struct outq *q, const char *buf, size_t len)
+{
+    struct logring *r = &q->ring;
+    size_t head, tail, off, n;
+    int err;
+
+    if ((err = atomic_load(&r->err) ) != 0) {
+        errno = err;
+        fatal_sys("write: %s", q->name);
+    }
+
+    while (len > 0) {
+        tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        head = atomic_load_explicit(&r->head, memory_order_acquire);
+        n = r->size - (tail - head);
+
+        if (n < len && g.opt.policy == POLICY_DROP) {
+            r->dropped += len;
+            return;
+        } else if (n < len && g.opt.policy == POLICY_FAIL) {
+            fatal(ERROR_GENERAL, "output to %s fell behind by more than %lu bytes",
+                  q->name, (unsigned long) r->size);
+        } else if (n == 0) {
+            pthread_mutex_lock(&lg.lock);
+            atomic_store(&lg.waiting, true);
+            if (atomic_load(&r->head) == head) {
+                pthread_cond_wait(&lg.space, &lg.lock);
+            }
+            atomic_store(&lg.waiting, false);
+            pthread_mutex_unlock(&lg.lock);
+            continue;
+        }
+
+        if (n > len) {
+            n = len;
+        }
+        off = tail & (r->size - 1);
+        if (off + n <= r->size) {
+            memcpy(r->buf + off, buf, n);
+        } else {
+            memcpy(r->buf + off, buf, r->size - off);
+            memcpy(r->buf, buf + (r->size - off), n - (r->size - off) );
+        }
+        atomic_store(&r->tail, tail + n);
+        buf += n;
+        len -= n;
+
+        if (atomic_load(&lg.idle) ) {
+            pthread_mutex_lock(&lg.lock);
+            pthread_cond_signal(&lg.wake);
+            pthread_mutex_unlock(&lg.lock);
+        }
+    }
+}
+
+/*
+ * Output queues. stdout has one so a reader which does not keep up does
+ * not block the event loop: what cannot be written right away is queued
+ * and flushed when the fd is writable. Past the high-water mark (-b) the
+ * -B policy decides: `block' stops reading the ptys until the queue
+ * drains, `fail' exits and `drop' only applies to logs (see above).
+ *
+ * Regular files cannot be non-blocking and are still written in place.
+ * A tty is reopened so O_NONBLOCK does not affect others sharing it, for
+ * pipes and sockets the original flags are restored at exit.
+ */
+void
+out_open(int i, int fd, const char *name)
+{
+    struct outq *q = &g.out[i];
+    struct stat st;
+    char *tty;
+    int fd2, flags;
+
+    q->name = name;
+    q->fd = fd;
+
+    if (fstat(fd, &st) < 0 || S_ISREG(st.st_mode) || S_ISBLK(st.st_mode) ) {
+        return;
+    }
+
+    if (isatty(fd) && (tty = ttyname(fd) ) != NULL
+        && (fd2 = open(tty, O_WRONLY | O_NOCTTY | O_NONBLOCK) ) >= 0) {
+        fcntl(fd2, F_SETFD, FD_CLOEXEC);
+        q->fd = fd2;
+        q->async = true;
+        return;
+    }
+
+    if ((flags = fcntl(fd, F_GETFL) ) < 0
+        || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return;
+    }
+    q->orig_flags = flags;
+    q->async = true;
+}
+
+void
+out_watch(struct outq *q, bool on)
+{
+    if (on && ! q->watched) {
+        ev_add(q->fd, EV_WRITE, q);
+    } else if (! on && q->watched) {
+        ev_del(q->fd);
+    }
+    q->watched = on;
+}
+
+/*
+ * A write error. The events fd just stops being written to, as whoever is
+ * reading it must not break the session.
+ */
+void
+out_error(struct outq *q)
+{
+    if (! q->lossy) {
+        fatal_sys("write: %s", q->name);
+    }
+    out_watch(q, false);
+    q->fd = -1;
+    q->len = 0;
+}
+
+/*
+ * Write what's queued until the fd would block.
+ */
+void
+out_flush(struct outq *q)
+{
+    ssize_t n;
+
+    while (q->len > 0) {
+        n = write(q->fd, q->buf + q->off, q->len);
+        ++q->writes;
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            break;
+        } else if (n < 0) {
+            out_error(q);
+            return;
+        }
+        q->nwritten += n;
+        q->off += n;
+        q->len -= n;
+    }
+    if (q->len == 0) {
+        q->off = 0;
+        out_watch(q, false);
+    }
+}
+
+void
+out_write(int i, const char *buf, size_t len)
+{
+    struct outq *q = &g.out[i];
+    ssize_t n;
+    size_t size;
+
+    if (q->fd < 0 || len == 0 || q->paused) {
+        return;
+    }
+    if (q->log) {
+        log_put(q, buf, len);
+        return;
+    }
+    if (! q->async) {
+        if (writen(q->fd, buf, len) != len) {
+            out_error(q);
+        }
+        ++q->writes;
+        q->nwritten += len;
+        return;
+    }
+
+    while (q->len == 0 && len > 0) {
+        n = write(q->fd, buf, len);
+        ++q->writes;
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            break;
+        } else if (n < 0) {
+            out_error(q);
+            return;
+        }
+        q->nwritten += n;
+        buf += n;
+        len -= n;
+    }
+    if (len == 0) {
+        return;
+    }
+
+    if (q->off + q->len + len > q->size) {
+        memmove(q->buf, q->buf + q->off, q->len);
+        q->off = 0;
+    }
+    if (q->len + len > q->size) {
+        size = q->size ? q->size : BUFFSIZE;
+        while (size < q->len + len) {
+            size *= 2;
+        }
+        if ((q->buf = realloc(q->buf, size) ) == NULL) {
+            fatal_sys("realloc");
+        }
+        q->size = size;
+    }
+    memcpy(q->buf + q->off + q->len, buf, len);
+    q->len += len;
+    out_watch(q, true);
+
+    if (g.opt.policy == POLICY_FAIL && q->len > g.opt.hiwat) {
+        /* it's stuck, don't try to flush it at exit */
+        q->len = 0;
+        fatal(ERROR_GENERAL, "output to %s fell behind by more than %lu bytes",
+              q->name, (unsigned long) g.opt.hiwat);
+    }
+}
+
+/*
+ * Whether any queue is over the high-water mark, in which case the ptys
+ * are not read.
+ */
+bool
+out_full(void)
+{
+    int i;
+
+    for (i = 0; i < NOUTS; ++i) {
+        if (g.out[i].lossy) {
+            continue;
+        }
+        if (g.out[i].stalled || g.out[i].len > g.opt.hiwat) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Flush everything before exit. With a timeout, give up when a queue
+ * makes no progress for that long.
+ */
+void
+out_drain(int timeout)
+{
+    struct outq *q;
+    int i;
+
+    for (i = 0; i < NOUTS; ++i) {
+        q = &g.out[i];
+        while (q->async && q->len > 0) {
+            if (! fd_wait(q->fd, EV_WRITE, timeout) ) {
+                break;
+            }
+            out_flush(q);
+        }
+    }
+}
+
+void
+out_atexit(void)
+{
+    int i;
+
+    log_stop();
+    out_drain(1000);
+
+    for (i = 0; i < NOUTS; ++i) {
+        if (g.out[i].orig_flags >= 0) {
+            fcntl(g.out[i].fd, F_SETFL, g.out[i].orig_flags);
+        }
+    }
+}
+
+/*
+ * Events (--events-fd), one JSON object per line, e.g.
+ *
+ *   {"ts":1700000000.123,"event":"spawned","session":"host1","pid":1234}
+ *
+ * They are queued like stdout but never hold up the sessions: past the
+ * high-water mark they are dropped, and the number dropped is in the
+ * next event that makes it.
+ */
+
+size_t
+json_put(char *dst, size_t size, size_t n, const char *src, size_t len)
+{
+    if (n + len < size) {
+        memcpy(dst + n, src, len);
+    }
+    return n + len;
+}
+
+/*
+ * `len' bytes of `src' as a quoted JSON string. Returns the length, or the
+ * size needed just like snprintf().
+ */
+int
+json_strn(char *dst, size_t size, const char *src, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p, *end = (const unsigned char *) src + len;
+    char esc[6] = { '\\', 'u', '0', '0' };
+    size_t n;
+
+    n = json_put(dst, size, 0, "\"", 1);
+    for (p = (const unsigned char *) src; p < end; ++p) {
+        if (*p == '"' || *p == '\\') {
+            esc[1] = *p;
+            n = json_put(dst, size, n, esc, 2);
+            esc[1] = 'u';
+        } else if (*p < 0x20) {
+            esc[4] = hex[*p >> 4];
+            esc[5] = hex[*p & 0xf];
+            n = json_put(dst, size, n, esc, 6);
+        } else {
+            n = json_put(dst, size, n, (const char *) p, 1);
+        }
+    }
+    n = json_put(dst, size, n, "\"", 1);
+
+    if (size > 0) {
+        dst[n < size ? n : size - 1] = '\0';
+    }
+    return n;
+}
+
+int
+json_str(char *dst, size_t size, const char *src)
+{
+    return json_strn(dst, size, src, strlen(src) );
+}
+
+/*
+ * Write event `name' of session `s' (NULL if none). `fmt' (NULL if none)
+ * formats more members, already in JSON.
+ */
+void
+event(struct session *s, const char *name, const char *fmt, ...)
+{
+    struct outq *q = &g.out[OUT_EVENTS];
+    char buf[2048];
+    struct timespec ts;
+    va_list ap;
+    int n;
+
+    if (q->fd < 0 && g.lib.cb.event == NULL) {
+        return;
+    }
+    if (q->fd >= 0 && q->len > g.opt.hiwat) {
+        ++g.events_dropped;
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    n = snprintf(buf, sizeof(buf), "{\"ts\":%lld.%03ld,\"event\":\"%s\"",
+                 (long long) ts.tv_sec, ts.tv_nsec / 1000000, name);
+    if (s != NULL) {
+        n += snprintf(buf + n, sizeof(buf) - n, ",\"session\":");
+        n += json_str(buf + n, n < sizeof(buf) ? sizeof(buf) - n : 0, s->label);
+        if (n < sizeof(buf) ) {
+            n += snprintf(buf + n, sizeof(buf) - n, ",\"pid\":%d", (int) s->pid);
+        }
+    }
+    if (g.events_dropped > 0 && n < sizeof(buf) ) {
+        n += snprintf(buf + n, sizeof(buf) - n, ",\"dropped\":%llu", g.events_dropped);
+    }
+    if (fmt != NULL && n < sizeof(buf) ) {
+        buf[n++] = ',';
+        va_start(ap, fmt);
+        n += vsnprintf(buf + n, sizeof(buf) - n, fmt, ap);
+        va_end(ap);
+    }
+    if (n >= sizeof(buf) - 2) {
+        ++g.events_dropped;
+        return;
+    }
+    buf[n++] = '}';
+    buf[n] = '\0';
+    if (g.lib.cb.event != NULL) {
+        g.lib.cb.event((passh_session *) s, name, buf, s != NULL ? s->arg : NULL);
+    }
+    buf[n++] = '\n';
+
+    g.events_dropped = 0;
+    out_write(OUT_EVENTS, buf, n);
+}
+
+/*
+ * How much each session has relayed, every EVENTS_INTERVAL ms while it's
+ * changing.
+ */
+void
+event_relayed(struct timer *t)
+{
+    struct session *s;
+    int i;
+
+    for (i = 0; i < g.nstarted; ++i) {
+        s = g.sessions[i];
+        if (s->state == SESS_RUNNING && s->nread != s->nreported) {
+            event(s, "relayed", "\"bytes\":%llu", s->nread);
+            s->nreported = s->nread;
+        }
+    }
+    timer_set(t, EVENTS_INTERVAL);
+}
+
+void
+event_open(int fd)
+{
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    out_open(OUT_EVENTS, fd, "events fd");
+    g.out[OUT_EVENTS].lossy = true;
+
+    timer_init(&g.t_events, event_relayed, NULL);
+    timer_set(&g.t_events, EVENTS_INTERVAL);
+}
+
+/*
+ * --stats and --stats-file. The counters are in struct stats of every
+ * session and in the output queues.
+ */
+void
+stats_latency(struct session *s)
+{
+    int64_t us = (now_ns() - s->st.read_at) / 1000;
+    int i;
+
+    for (i = 0; i < STATS_BUCKETS - 1 && us > (1LL << i); ++i)
+        ;
+    ++s->st.latency[i];
+    ++s->st.nlatency;
+    s->st.latency_sum += us;
+    if (us > s->st.latency_max) {
+        s->st.latency_max = us;
+    }
+}
+
+double
+tv2sec(struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+void
+stats_print(void)
+{
+    unsigned long long latency[STATS_BUCKETS] = { 0 }, nread;
+    struct session *s;
+    struct rusage ru;
+    int i, j;
+
+    fprintf(stderr, "passh stats:\r\n");
+    for (i = 0; i < g.nstarted; ++i) {
+        s = g.sessions[i];
+        nread = s->st.nread + s->nread;
+        fprintf(stderr, "  %s: read %llu bytes in %llu calls (avg %llu), "
+                "wrote %llu bytes in %llu calls\r\n", s->label, nread, s->st.reads,
+                nread / (s->st.reads ? s->st.reads : 1), s->st.nwritten, s->st.writes);
+        fprintf(stderr, "      matcher %llu calls in %.3fms, regexec %llu calls in %.3fms\r\n",
+                s->st.matches, s->st.match_time / 1e6, s->st.regexecs,
+                s->st.regexec_time / 1e6);
+        if (s->st.first_output != 0) {
+            fprintf(stderr, "      first output after %.3fms",
+                    (s->st.first_output - s->st.spawned) / 1e6);
+        } else {
+            fprintf(stderr, "      no output");
+        }
+        if (s->st.nlatency > 0) {
+            fprintf(stderr, ", password sent %lldus after the prompt (avg of %llu, max %lldus)",
+                    (long long) (s->st.latency_sum / s->st.nlatency), s->st.nlatency,
+                    (long long) s->st.latency_max);
+        }
+        fprintf(stderr, "\r\n      child cpu %.3fs user + %.3fs sys", tv2sec(&s->st.utime),
+                tv2sec(&s->st.stime) );
+        if (s->restarts > 0) {
+            fprintf(stderr, ", %d restarts", s->restarts);
+        }
+        fprintf(stderr, "\r\n");
+        for (j = 0; j < STATS_BUCKETS; ++j) {
+            latency[j] += s->st.latency[j];
+        }
+    }
+
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(stderr, "  passh: cpu %.3fs user + %.3fs sys, stdout %llu bytes in %llu writes\r\n",
+            tv2sec(&ru.ru_utime), tv2sec(&ru.ru_stime),
+            g.out[OUT_STDOUT].nwritten, g.out[OUT_STDOUT].writes);
+    for (j = 0; j < STATS_BUCKETS && latency[j] == 0; ++j)
+        ;
+    if (j < STATS_BUCKETS) {
+        fprintf(stderr, "  password latency (us):");
+        for (; j < STATS_BUCKETS; ++j) {
+            if (latency[j] == 0) {
+                continue;
+            } else if (j < STATS_BUCKETS - 1) {
+                fprintf(stderr, " <=%lld: %llu", 1LL << j, latency[j]);
+            } else {
+                fprintf(stderr, " more: %llu", latency[j]);
+            }
+        }
+        fprintf(stderr, "\r\n");
+    }
+}
+
+/*
+ * A label value in the Prometheus text format.
+ */
+void
+prom_label(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (; *str != '\0'; ++str) {
+        if (*str == '\\' || *str == '"') {
+            fputc('\\', fp);
+            fputc(*str, fp);
+        } else if (*str == '\n') {
+            fputs("\\n", fp);
+        } else {
+            fputc(*str, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+void
+prom_header(FILE *fp, const char *name, const char *type, const char *help)
+{
+    fprintf(fp, "# HELP passh_%s %s\n# TYPE passh_%s %s\n", name, help, name, type);
+}
+
+/*
+ * All the stats in the Prometheus text format, for --stats-file and the
+ * `stats' of --control.
+ */
+void
+stats_prom(FILE *fp)
+{
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t off;
+        bool time;                  /* in ns, written in seconds */
+    } counters[] = {
+        { "pty_reads_total", "read() and splice() calls on the pty.",
+          offsetof(struct stats, reads), false },
+        { "pty_written_bytes_total", "Bytes written to the pty.",
+          offsetof(struct stats, nwritten), false },
+        { "pty_writes_total", "Writes to the pty.",
+          offsetof(struct stats, writes), false },
+        { "matcher_calls_total", "Calls of the prompt matcher.",
+          offsetof(struct stats, matches), false },
+        { "matcher_seconds_total", "Time spent matching prompts (with --stats).",
+          offsetof(struct stats, match_time), true },
+        { "regexec_calls_total", "regexec() calls for the rules the matcher cannot do.",
+          offsetof(struct stats, regexecs), false },
+        { "regexec_seconds_total", "Time spent in regexec() (with --stats).",
+          offsetof(struct stats, regexec_time), true },
+    };
+    struct session *s;
+    struct rusage ru;
+    unsigned long long n;
+    int c, i, j;
+
+    prom_header(fp, "pty_read_bytes_total", "counter", "Bytes read from the pty.");
+    for (i = 0; i < g.nstarted; ++i) {
+        s = g.sessions[i];
+        fprintf(fp, "passh_pty_read_bytes_total{session=");
+        prom_label(fp, s->label);
+        fprintf(fp, "} %llu\n", s->st.nread + s->nread);
+    }
+    for (c = 0; c < sizeof(counters) / sizeof(counters[0]); ++c) {
+        prom_header(fp, counters[c].name, "counter", counters[c].help);
+        for (i = 0; i < g.nstarted; ++i) {
+            s = g.sessions[i];
+            fprintf(fp, "passh_%s{session=", counters[c].name);
+            prom_label(fp, s->label);
+            if (counters[c].time) {
+                fprintf(fp, "} %.9f\n",
+                        *(int64_t *) ((char *) &s->st + counters[c].off) / 1e9);
+            } else {
+                fprintf(fp, "} %llu\n",
+                        *(unsigned long long *) ((char *) &s->st + counters[c].off) );
+            }
+        }
+    }
+
+    prom_header(fp, "first_output_seconds", "gauge",
+                "From starting the command till its first output (with --stats).");
+    for (i = 0; i < g.nstarted; ++i) {
+        s = g.sessions[i];
+        if (s->st.first_output != 0) {
+            fprintf(fp, "passh_first_output_seconds{session=");
+            prom_label(fp, s->label);
+            fprintf(fp, "} %.9f\n", (s->st.first_output - s->st.spawned) / 1e9);
+        }
+    }
+
+    prom_header(fp, "password_latency_seconds", "histogram",
+                "From reading a password prompt till the password is sent (with --stats).");
+    for (i = 0; i < g.nstarted; ++i) {
+        s = g.sessions[i];
+        for (j = 0, n = 0; j < STATS_BUCKETS; ++j) {
+            n += s->st.latency[j];
+            fprintf(fp, "passh_password_latency_seconds_bucket{session=");
+            prom_label(fp, s->label);
+            if (j < STATS_BUCKETS - 1) {
+                fprintf(fp, ",le=\"%g\"} %llu\n", (1LL << j) / 1e6, n);
+            } else {
+                fprintf(fp, ",le=\"+Inf\"} %llu\n", n);
+            }
+        }
+        fprintf(fp, "passh_password_latency_seconds_sum{session=");
+        prom_label(fp, s->label);
+        fprintf(fp, "} %.6f\n", s->st.latency_sum / 1e6);
+        fprintf(fp, "passh_password_latency_seconds_count{session=");
+        prom_label(fp, s->label);
+        fprintf(fp, "} %llu\n", s->st.nlatency);
+    }
+
+    prom_header(fp, "child_cpu_seconds_total", "counter", "CPU time of the command.");
+    for (i = 0; i < g.nstarted; ++i) {
+        s = g.sessions[i];
+        fprintf(fp, "passh_child_cpu_seconds_total{session=");
+        prom_label(fp, s->label);
+        fprintf(fp, ",mode=\"user\"} %.6f\n", tv2sec(&s->st.utime) );
+        fprintf(fp, "passh_child_cpu_seconds_total{session=");
+        prom_label(fp, s->label);
+        fprintf(fp, ",mode=\"system\"} %.6f\n", tv2sec(&s->st.stime) );
+    }
+
+    prom_header(fp, "restarts_total", "counter", "Restarts of the command (--supervise).");
+    for (i = 0; i < g.nstarted; ++i) {
+        s = g.sessions[i];
+        fprintf(fp, "passh_restarts_total{session=");
+        prom_label(fp, s->label);
+        fprintf(fp, "} %d\n", s->restarts);
+    }
+
+    getrusage(RUSAGE_SELF, &ru);
+    prom_header(fp, "cpu_seconds_total", "counter", "CPU time of passh itself.");
+    fprintf(fp, "passh_cpu_seconds_total{mode=\"user\"} %.6f\n", tv2sec(&ru.ru_utime) );
+    fprintf(fp, "passh_cpu_seconds_total{mode=\"system\"} %.6f\n", tv2sec(&ru.ru_stime) );
+    prom_header(fp, "stdout_written_bytes_total", "counter", "Bytes written to stdout.");
+    fprintf(fp, "passh_stdout_written_bytes_total %llu\n", g.out[OUT_STDOUT].nwritten);
+    prom_header(fp, "stdout_writes_total", "counter", "write() and splice() calls to stdout.");
+    fprintf(fp, "passh_stdout_writes_total %llu\n", g.out[OUT_STDOUT].writes);
+}
+
+/*
+ * Written to a temporary file renamed over `path' so a collector never
+ * sees half of it.
+ */
+void
+stats_write(char *path)
+{
+    char tmp[PATH_MAX];
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid() );
+    if ((fp = fopen(tmp, "w") ) == NULL) {
+        fprintf(stderr, "!! %s: %s\r\n", tmp, strerror(errno) );
+        return;
+    }
+    stats_prom(fp);
+    if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+        fprintf(stderr, "!! %s: %s\r\n", path, strerror(errno) );
+        unlink(tmp);
+    }
+}
+
+void
+stats_atexit(void)
+{
+    /* not in a child which failed to exec */
+    if (getpid() != g.pid) {
+        return;
+    }
+    if (g.opt.stats) {
+        stats_print();
+    }
+    if (g.opt.stats_file != NULL) {
+        stats_write(g.opt.stats_file);
+    }
+}
+
+/*
+ * --tail: the last output of every session is kept in a ring, and only
+ * written out when the session fails.
+ */
+void
+tail_put(struct session *s, const char *buf, size_t len)
+{
+    size_t size = g.opt.tail, off, n;
+
+    if (s->tail == NULL) {
+        return;
+    }
+    if (len > size) {
+        s->ntail += len - size;
+        buf += len - size;
+        len = size;
+    }
+    off = s->ntail % size;
+    n = off + len <= size ? len : size - off;
+    memcpy(s->tail + off, buf, n);
+    memcpy(s->tail, buf + n, len - n);
+    s->ntail += len;
+}
+
+void
+tail_flush(struct session *s, int exit_code)
+{
+    size_t size = g.opt.tail, off, n;
+    char *path = NULL;
+    int fd = STDERR_FILENO;
+
+    if (s->tail == NULL || s->ntail == 0) {
+        return;
+    }
+    if (g.opt.tail_file != NULL) {
+        if (! g.fleet || (path = str_replace(g.opt.tail_file, "{}", s->label) ) == NULL) {
+            path = g.opt.tail_file;
+        }
+        fd = open(path, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            fprintf(stderr, "!! %s: %s\r\n", path, strerror(errno) );
+            goto done;
+        }
+    }
+
+    n = s->ntail < size ? s->ntail : size;
+    off = s->ntail < size ? 0 : s->ntail % size;
+    dprintf(fd, "==> %s: exited with %d, the last %lu of %llu bytes <==\r\n", s->label,
+            exit_code, (unsigned long) n, (unsigned long long) s->ntail);
+    writen(fd, s->tail + off, n - off);
+    writen(fd, s->tail, off);
+    dprintf(fd, "\r\n");
+
+    if (fd != STDERR_FILENO) {
+        close(fd);
+    }
+done:
+    if (path != g.opt.tail_file) {
+        free(path);
+    }
+    s->ntail = 0;
+}
+
+/*
+ * --record: what goes in and out of the ptys, with timing, for --replay.
+ * The file starts with REC_MAGIC and the wall clock time of the start (in
+ * us), then every chunk has a header of REC_HDRSIZE bytes:
+ *
+ *      7 bytes     ns since the start (CLOCK_MONOTONIC)
+ *      1 byte      REC_START, REC_OUTPUT, REC_INPUT, REC_SENT or REC_EXIT
+ *      4 bytes     the length of the data which follows
+ *      4 bytes     the session, an index in the -F hosts
+ *
+ * All numbers are little-endian. REC_START's data is the window size (2
+ * bytes each of columns and rows, 0 if unknown) and the host, REC_EXIT's
+ * the exit status (4 bytes). The password is recorded as `********' like
+ * in the -l log.
+ *
+ * It's written by the log thread like -l/-L. A chunk goes to the ring in
+ * one piece so `-B drop' drops whole chunks.
+ */
+static struct {
+    int64_t t0;
+    char *buf;
+} rec;
+
+void
+rec_le(char *p, uint64_t v, int n)
+{
+    while (n-- > 0) {
+        *p++ = v & 0xff;
+        v >>= 8;
+    }
+}
+
+uint64_t
+rec_get(const char *p, int n)
+{
+    uint64_t v = 0;
+
+    while (n-- > 0) {
+        v = v << 8 | (unsigned char) p[n];
+    }
+    return v;
+}
+
+void
+rec_put(struct session *s, int type, const char *buf, size_t len)
+{
+    size_t n;
+
+    if (g.out[OUT_RECORD].fd < 0) {
+        return;
+    }
+    do {
+        n = len < RELAY_BUFFSIZE ? len : RELAY_BUFFSIZE;
+        rec_le(rec.buf, now_ns() - rec.t0, 7);
+        rec.buf[7] = type;
+        rec_le(rec.buf + 8, n, 4);
+        rec_le(rec.buf + 12, s->id, 4);
+        memcpy(rec.buf + REC_HDRSIZE, buf, n);
+        out_write(OUT_RECORD, rec.buf, REC_HDRSIZE + n);
+        buf += n;
+        len -= n;
+    } while (len > 0);
+}
+
+void
+rec_start(struct session *s, struct winsize *size)
+{
+    char data[4 + 1024];
+    size_t n = strlen(s->label);
+
+    if (n > sizeof(data) - 4) {
+        n = sizeof(data) - 4;
+    }
+    rec_le(data, size != NULL ? size->ws_col : 0, 2);
+    rec_le(data + 2, size != NULL ? size->ws_row : 0, 2);
+    memcpy(data + 4, s->label, n);
+    rec_put(s, REC_START, data, 4 + n);
+}
+
+void
+rec_open(const char *path)
+{
+    char hdr[16];
+    struct timeval tv;
+    int fd;
+
+    fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+    if (fd < 0) {
+        fatal_sys("open: %s", path);
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    rec.t0 = now_ns();
+    gettimeofday(&tv, NULL);
+    memcpy(hdr, REC_MAGIC, 8);
+    rec_le(hdr + 8, tv.tv_sec * 1000000ULL + tv.tv_usec, 8);
+    if (writen(fd, hdr, sizeof(hdr) ) != sizeof(hdr) ) {
+        fatal_sys("write: %s", path);
+    }
+    if ((rec.buf = malloc(REC_HDRSIZE + RELAY_BUFFSIZE) ) == NULL) {
+        fatal_sys("malloc");
+    }
+    log_open(OUT_RECORD, fd, path);
+}
+
+void session_fatal(struct session *s, int rcode, const char *fmt, ...);
+
+/*
+ * Write to the pty master. What the child isn't ready to read is queued
+ * and written by pty_flush() once the pty is writable, so a child not
+ * reading its input holds up nothing else. Returns false if the session
+ * has failed.
+ */
+bool
+pty_send(struct session *s, const char *buf, size_t len)
+{
+    ssize_t n;
+    size_t size;
+
+    if (s->fd_ptym < 0) {
+        return false;
+    }
+    while (s->wlen == 0 && ! s->opening && len > 0) {
+        n = write(s->fd_ptym, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            break;
+        } else if (n < 0) {
+            session_fatal(s, ERROR_GENERAL, "write: %s", strerror(errno) );
+            return false;
+        }
+        ++s->st.writes;
+        s->st.nwritten += n;
+        buf += n;
+        len -= n;
+    }
+    if (len == 0) {
+        return true;
+    }
+
+    if (s->woff + s->wlen + len > s->wsize) {
+        memmove(s->wbuf, s->wbuf + s->woff, s->wlen);
+        s->woff = 0;
+    }
+    if (s->wlen + len > s->wsize) {
+        size = s->wsize ? s->wsize : BUFFSIZE;
+        while (size < s->wlen + len) {
+            size *= 2;
+        }
+        if ((s->wbuf = realloc(s->wbuf, size) ) == NULL) {
+            fatal_sys("realloc");
+        }
+        s->wsize = size;
+    }
+    if (s->wlen == 0 && ! s->opening) {
+        ev_mod(s->fd_ptym, EV_READ | EV_WRITE | EV_EDGE, s);
+    }
+    memcpy(s->wbuf + s->woff + s->wlen, buf, len);
+    s->wlen += len;
+    return true;
+}
+
+/*
+ * The pty is writable again: write what pty_send() has queued.
+ */
+void
+pty_flush(struct session *s)
+{
+    ssize_t n;
+
+    while (s->wlen > 0) {
+        n = write(s->fd_ptym, s->wbuf + s->woff, s->wlen);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            return;
+        } else if (n < 0) {
+            session_fatal(s, ERROR_GENERAL, "write: %s", strerror(errno) );
+            return;
+        }
+        ++s->st.writes;
+        s->st.nwritten += n;
+        s->woff += n;
+        s->wlen -= n;
+    }
+    s->woff = 0;
+    ev_mod(s->fd_ptym, EV_READ | EV_EDGE, s);
+}
+
+/*
+ * Write to the pty and the -l log.
+ */
+void
+pty_write(struct session *s, const char *buf, size_t len)
+{
+    if (! pty_send(s, buf, len) ) {
+        return;
+    }
+    out_write(OUT_TO_PTY, buf, len);
+    if (g.opt.tail_input) {
+        tail_put(s, buf, len);
+    }
+    /* the user typing, or an answer to a prompt */
+    rec_put(s, s->now_interactive ? REC_INPUT : REC_SENT, buf, len);
+}
+
+/*
+ * Like fatal() but in fleet mode (or with --supervise) only the session is
+ * given up: the pty is closed (so the child gets SIGHUP) and other sessions
+ * keep running.
+ */
+void
+session_fatal(struct session *s, int rcode, const char *fmt, ...)
+{
+    va_list ap;
+    char buf[1024], msg[1024];
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    json_str(msg, sizeof(msg), buf);
+    event(s, "error", "\"code\":%d,\"message\":%s", rcode, msg);
+    /* with --supervise it's for session_supervise() to decide */
+    if (! g.fleet && ! g.opt.supervise) {
+        tail_flush(s, rcode);
+        fatal(rcode, "%s", buf);
+    }
+
+    if (! g.lib.on) {
+        fprintf(stderr, "!! %s: %s\r\n", s->label, buf);
+    }
+
+    s->exit_code = rcode;
+    s->failed = true;
+
+    ev_del(s->fd_ptym);
+    close(s->fd_ptym);
+    s->fd_ptym = -1;
+    s->woff = s->wlen = 0;
+    s->unread = false;
+    s->opening = false;
+    timer_cancel(&s->t_prompt);
+    timer_cancel(&s->t_open);
+    if (s->agent != NULL) {
+        agent_req_free(s->agent);
+    }
+
+    /* the SIGHUP is not enough for `-n' or a child ignoring it */
+    kill(s->pid, SIGTERM);
+    timer_set(&s->t_kill, KILL_DELAY);
+}
+
+void
+session_kill(struct timer *t)
+{
+    struct session *s = t->arg;
+
+    if (s->state == SESS_RUNNING) {
+        kill(s->pid, SIGKILL);
+    }
+}
+
+/*
+ * Decide which rules are still to be matched.
+ */
+void
+rules_update(struct session *s)
+{
+    struct rule *rule;
+    int i;
+
+    s->enabled = 0;
+    for (i = 0; i < g.nrules; ++i) {
+        rule = &g.rules[i];
+        if (i == g.rule_yesno && s->passwords_seen > 0) {
+            continue;
+        }
+        if (! rule->fatal_more && rule->max != 0 && s->counts[i] >= rule->max) {
+            continue;
+        }
+        s->enabled |= (uint64_t) 1 << i;
+    }
+    if (s->enabled == 0) {
+        s->given_up = true;
+    }
+}
+
+/*
+ * Tell whoever is waiting for us (--ready) that every session has logged in.
+ */
+void
+notify_ready(void)
+{
+    struct sockaddr_un addr;
+    char *path;
+    int fd;
+
+    if (g.opt.ready_fd >= 0) {
+        write(g.opt.ready_fd, "READY=1\n", 8);
+        close(g.opt.ready_fd);
+        g.opt.ready_fd = -1;
+    } else if (g.opt.ready_file != NULL) {
+        if ((fd = open(g.opt.ready_file, O_CREAT | O_WRONLY | O_TRUNC, 0644) ) < 0) {
+            fatal_sys("open: %s", g.opt.ready_file);
+        }
+        close(fd);
+    } else if (g.opt.ready_systemd && (path = getenv("NOTIFY_SOCKET") ) != NULL
+               && (fd = socket(AF_UNIX, SOCK_DGRAM, 0) ) >= 0) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        /* abstract namespace */
+        if (addr.sun_path[0] == '@') {
+            addr.sun_path[0] = '\0';
+        }
+        sendto(fd, "READY=1", 7, 0, (const struct sockaddr *) &addr,
+               offsetof(struct sockaddr_un, sun_path) + strlen(path) );
+        close(fd);
+    }
+}
+
+void
+session_ready(struct session *s)
+{
+    if (s->ready || (! g.opt.ready && ! g.opt.supervise) ) {
+        return;
+    }
+    s->ready = true;
+    timer_cancel(&s->t_ready);
+    event(s, "ready", NULL);
+
+    if (s->down_since != 0) {
+        if (! g.lib.on) {
+            fprintf(stderr, "!! %s: recovered in %lldms after %d restart(s)\r\n",
+                    s->label, (long long) (now_ms() - s->down_since), s->restarts);
+        }
+        event(s, "recovered", "\"restarts\":%d,\"ms\":%lld",
+              s->restarts, (long long) (now_ms() - s->down_since) );
+        s->down_since = 0;
+    }
+    if (g.opt.ready && ++g.nready == g.nsessions) {
+        notify_ready();
+    }
+}
+
+/*
+ * --ready-after expired: no more password prompts.
+ */
+void
+ready_timeout(struct timer *t)
+{
+    struct session *s = t->arg;
+
+    if (s->state == SESS_RUNNING && s->fd_ptym >= 0) {
+        session_ready(s);
+    }
+}
+
+void session_start(struct session *s);
+
+/*
+ * --supervise: start the child again after a delay. The delay doubles
+ * with every restart (up to <max>), with jitter so a fleet that went down
+ * together does not come back in lockstep. It's reset once a child has
+ * stayed up for <max>.
+ */
+void
+session_supervise(struct session *s)
+{
+    int64_t now = now_ms();
+    int delay;
+
+    if (s->exit_code == 0 || (s->failed && s->exit_code == ERROR_MAX_TRIES)
+        || (g.opt.supervise_max > 0 && s->restarts >= g.opt.supervise_max) ) {
+        return;
+    }
+
+    if (s->backoff == 0 || now - s->started >= g.opt.backoff_max) {
+        s->backoff = g.opt.backoff_min;
+    }
+    delay = s->backoff / 2 + random() % (s->backoff / 2 + 1);
+    s->backoff = s->backoff * 2 < g.opt.backoff_max ? s->backoff * 2 : g.opt.backoff_max;
+
+    if (s->down_since == 0) {
+        s->down_since = now;
+    }
+    ++s->restarts;
+    ++g.nrestarting;
+    if (! g.lib.on) {
+        fprintf(stderr, "!! %s: exited with %d, restart #%d in %dms\r\n",
+                s->label, s->exit_code, s->restarts, delay);
+    }
+    event(s, "restarting", "\"code\":%d,\"restarts\":%d,\"delay\":%d",
+          s->exit_code, s->restarts, delay);
+    timer_set(&s->t_restart, delay);
+}
+
+void
+session_restart(struct timer *t)
+{
+    struct session *s = t->arg;
+
+    if (s->ready && g.opt.ready) {
+        --g.nready;
+    }
+    s->failed = false;
+    s->given_up = false;
+    s->now_interactive = false;
+    s->passthru = false;
+    s->unread = false;
+    s->pktmode = false;
+    s->ready = false;
+    s->passwords_seen = 0;
+    memset(s->counts, 0, sizeof(s->counts) );
+    s->st.nread += s->nread;
+    s->nread = s->nreported = 0;
+
+    --g.nrestarting;
+    session_start(s);
+}
+
+/*
+ * -t expired: no (more) password prompt within the time.
+ */
+void
+session_timeout(struct timer *t)
+{
+    struct session *s = t->arg;
+
+    if (s->state != SESS_RUNNING || s->fd_ptym < 0) {
+        return;
+    }
+    event(s, "timeout", NULL);
+    if (g.opt.fatal_no_prompt && s->passwords_seen == 0) {
+        session_fatal(s, ERROR_TIMEOUT, "timeout waiting for password prompt");
+    } else {
+        s->given_up = true;
+    }
+}
+
+/*
+ * With -F the ssh helpers of reuse_command() are run by the event loop, so
+ * a host starting holds up none of those running. A job looks up the
+ * master of a session (`ssh -G'), closes masters (`ssh -O exit') till
+ * there's room for a new one if need be, and then starts the session.
+ * A helper is done once its stdout is closed and it's been reaped on
+ * SIGCHLD. Sessions waiting for a job count as running for -j.
+ */
+struct reuse_job {
+    struct session *s;
+    pid_t pid;                  /* the helper, 0 when there's none */
+    int fd;                     /* its stdout, -1 once closed */
+    bool exited;
+    int status;
+    bool evicting;              /* `ssh -O exit', else `ssh -G' */
+    char oldest[PATH_MAX];      /* being closed */
+    char *out;                  /* of `ssh -G' */
+    size_t len;
+    size_t size;
+    struct reuse_job *next;
+};
+
+static struct reuse_job *reuse_jobs;
+
+void
+reuse_spawn(struct reuse_job *j, char **argv)
+{
+    j->pid = ssh_spawn(argv, &j->fd);
+    j->exited = false;
+    fcntl(j->fd, F_SETFD, FD_CLOEXEC);
+    fcntl(j->fd, F_SETFL, fcntl(j->fd, F_GETFL) | O_NONBLOCK);
+    ev_add(j->fd, EV_READ, j);
+}
+
+/*
+ * Close the oldest master if there's no room, else start the session.
+ */
+void
+reuse_next(struct reuse_job *j)
+{
+    struct session *s = j->s;
+    struct reuse_job **pp;
+    char *argv[] = { s->command[0], "-S", j->oldest, "-O", "exit", MY_NAME, NULL };
+
+    if (! s->reused && reuse_full(j->oldest) ) {
+        j->evicting = true;
+        reuse_spawn(j, argv);
+        return;
+    }
+
+    for (pp = &reuse_jobs; *pp != j; pp = &(*pp)->next)
+        ;
+    *pp = j->next;
+    free(j->out);
+    free(j);
+
+    reuse_rewrite(s);
+    --g.nrunning;
+    session_start(s);
+}
+
+/*
+ * A helper is done.
+ */
+void
+reuse_step(struct reuse_job *j)
+{
+    struct session *s = j->s;
+    char *line, *nl;
+
+    if (j->fd >= 0 || ! j->exited) {
+        return;
+    }
+    j->pid = 0;
+
+    if (j->evicting) {
+        /* if that fails the master is gone anyway */
+        if (! WIFEXITED(j->status) || WEXITSTATUS(j->status) != 0) {
+            unlink(j->oldest);
+        }
+        reuse_next(j);
+        return;
+    }
+
+    for (line = j->out; line != NULL && s->reuse_path == NULL; line = nl) {
+        if ((nl = strchr(line, '\n')) != NULL) {
+            *nl++ = '\0';
+        }
+        if (strncmp(line, "controlpath ", 12) == 0
+            && (s->reuse_path = strdup(line + 12)) == NULL) {
+            fatal_sys("strdup");
+        }
+    }
+    if (! WIFEXITED(j->status) || WEXITSTATUS(j->status) != 0 || s->reuse_path == NULL) {
+        fatal(ERROR_GENERAL, "Error: `%s -G' failed", s->command[0]);
+    }
+    s->reused = reuse_alive(s->reuse_path);
+    reuse_next(j);
+}
+
+/*
+ * Start looking up the master of `s'. session_start() is called again
+ * when it's been found.
+ */
+void
+reuse_lookup(struct session *s)
+{
+    struct reuse_job *j;
+    char **argv;
+
+    if ((j = calloc(1, sizeof(*j) ) ) == NULL) {
+        fatal_sys("calloc");
+    }
+    j->s = s;
+    j->next = reuse_jobs;
+    reuse_jobs = j;
+    ++g.nrunning;
+
+    argv = reuse_config_argv(s->command);
+    reuse_spawn(j, argv);
+    reuse_config_free(argv);
+}
+
+/*
+ * Output of a helper, only `ssh -G' has any.
+ */
+void
+reuse_read(struct reuse_job *j)
+{
+    ssize_t n;
+
+    while (true) {
+        if (j->len + 1 == j->size || j->size == 0) {
+            j->size = j->size ? 2 * j->size : BUFFSIZE;
+            if ((j->out = realloc(j->out, j->size) ) == NULL) {
+                fatal_sys("realloc");
+            }
+        }
+        n = read(j->fd, j->out + j->len, j->size - 1 - j->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            return;
+        } else if (n <= 0) {
+            break;
+        }
+        j->len += n;
+        j->out[j->len] = '\0';
+    }
+    j->out[j->len] = '\0';
+    ev_del(j->fd);
+    close(j->fd);
+    j->fd = -1;
+    reuse_step(j);
+}
+
+/*
+ * Whether `data' of an event is a job (and handle it).
+ */
+bool
+reuse_event(void *data)
+{
+    struct reuse_job *j;
+
+    for (j = reuse_jobs; j != NULL; j = j->next) {
+        if (j == data) {
+            reuse_read(j);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * A helper with `pid' has exited. Returns false if it's not one of ours.
+ */
+bool
+reuse_reaped(pid_t pid, int status)
+{
+    struct reuse_job *j;
+
+    for (j = reuse_jobs; j != NULL; j = j->next) {
+        if (j->pid == pid && ! j->exited) {
+            j->exited = true;
+            j->status = status;
+            reuse_step(j);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Where there's no waitid(WNOWAIT) for reap_children() every helper is
+ * tried on SIGCHLD.
+ */
+void
+reuse_reap(void)
+{
+    struct reuse_job *j, *next;
+    int status;
+
+    for (j = reuse_jobs; j != NULL; j = next) {
+        next = j->next;
+        if (j->pid != 0 && ! j->exited && waitpid(j->pid, &status, WNOHANG) == j->pid) {
+            reuse_reaped(j->pid, status);
+        }
+    }
+}
+
+/*
+ * The sessions hashed by the pid of their child, so a child which has
+ * changed state is found without looking at every session.
+ */
+void
+pid_add(struct session *s)
+{
+    struct session **bucket = &g.pids[s->pid % PID_BUCKETS];
+
+    s->pid_next = *bucket;
+    *bucket = s;
+}
+
+void
+pid_del(struct session *s)
+{
+    struct session **pp;
+
+    for (pp = &g.pids[s->pid % PID_BUCKETS]; *pp != NULL; pp = &(*pp)->pid_next) {
+        if (*pp == s) {
+            *pp = s->pid_next;
+            return;
+        }
+    }
+}
+
+struct session *
+session_by_pid(pid_t pid)
+{
+    struct session *s;
+
+    for (s = g.pids[pid % PID_BUCKETS]; s != NULL; s = s->pid_next) {
+        if (s->pid == pid) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+void
+session_open_timeout(struct timer *t)
+{
+    session_fatal(t->arg, ERROR_GENERAL, "failed to wait for ptym to be writable");
+}
+
+/*
+ * The child has opened the pty (it's writable), so it can be made
+ * non-blocking: on Mac fcntl(O_NONBLOCK) may fail before that.
+ */
+void
+session_opened(struct session *s)
+{
+    s->opening = false;
+    timer_cancel(&s->t_open);
+
+    /* so session_relay() can drain it until EAGAIN */
+    if (fcntl(s->fd_ptym, F_SETFL, fcntl(s->fd_ptym, F_GETFL) | O_NONBLOCK) < 0) {
+        session_fatal(s, ERROR_GENERAL, "fcntl(O_NONBLOCK) error on ptym: %s",
+                      strerror(errno) );
+        return;
+    }
+    ev_mod(s->fd_ptym, EV_READ | EV_EDGE | (s->wlen > 0 ? EV_WRITE : 0), s);
+
+    /* a live --reuse master won't ask for a password */
+    if (s->reused && g.opt.ready_pattern == NULL) {
+        session_ready(s);
+    }
+}
+
+void
+session_start(struct session *s)
+{
+    char slave_name[32];
+    pid_t pid = -1;
+    struct termios orig_termios, *termp = NULL;
+    struct winsize size, *sizep = NULL;
+    int fds[2] = { -1, -1 };
+
+    if (g.opt.reuse_dir != NULL && s->reuse_path == NULL) {
+        if (g.fleet) {
+            reuse_lookup(s);
+            return;
+        }
+        reuse_command(s);
+    }
+    if (g.opt.stream_stdin && ! g.stdin_is_tty && pipe(fds) < 0) {
+        fatal_sys("pipe");
+    }
+
+    if (g.stdin_is_tty) {
+        if (tcgetattr(STDIN_FILENO, &orig_termios) < 0)
+            fatal_sys("tcgetattr error on stdin");
+        if (ioctl(STDIN_FILENO, TIOCGWINSZ, (char *) &size) < 0)
+            fatal_sys("TIOCGWINSZ error");
+        termp = &orig_termios;
+        sizep = &size;
+    }
+
+#if defined(PTY_SPAWN)
+    /* SIGHUP can't be ignored only in the child, fork() for -n */
+    if (! g.opt.use_fork && ! g.opt.nohup_child) {
+        if (fds[1] >= 0) {
+            fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        }
+        pid = pty_spawn(&s->fd_ptym, s->command, fds[0], termp, sizep);
+    }
+#endif
+    if (pid < 0) {
+        pid = pty_fork(&s->fd_ptym, slave_name, sizeof(slave_name), termp, sizep);
+    }
+
+    if (pid < 0) {
+        fatal_sys("fork error");
+    } else if (pid == 0) {
+        /*
+         * child
+         */
+        sigprocmask(SIG_SETMASK, &g.orig_sigmask, NULL);
+        if (fds[0] >= 0) {
+            if (dup2(fds[0], STDIN_FILENO) < 0) {
+                fatal_sys("dup2 error to stdin");
+            }
+            close(fds[0]);
+            close(fds[1]);
+        }
+        if (g.sigpipe_ignored) {
+            sig_handle(SIGPIPE, SIG_DFL);
+        }
+        if (g.opt.nohup_child) {
+            sig_handle(SIGHUP, SIG_IGN);
+        }
+        if (execvp(s->command[0], s->command) < 0)
+            fatal_sys("can't execute: %s", s->command[0]);
+    }
+
+    /*
+     * parent
+     */
+    pid_del(s);
+    s->pid = pid;
+    pid_add(s);
+    s->state = SESS_RUNNING;
+    event(s, "spawned", NULL);
+    if (fds[0] >= 0) {
+        close(fds[0]);
+        g.in.fd = fds[1];
+        fcntl(g.in.fd, F_SETFD, FD_CLOEXEC);
+        if (fcntl(g.in.fd, F_SETFL, fcntl(g.in.fd, F_GETFL) | O_NONBLOCK) < 0) {
+            fatal_sys("fcntl(O_NONBLOCK) error on stdin pipe");
+        }
+    }
+    s->exit_code = -1;
+    timer_init(&s->t_prompt, session_timeout, s);
+    timer_init(&s->t_ready, ready_timeout, s);
+    timer_init(&s->t_restart, session_restart, s);
+    timer_init(&s->t_kill, session_kill, s);
+    timer_init(&s->t_open, session_open_timeout, s);
+    s->started = now_ms();
+    rec_start(s, sizep);
+    if (s->st.spawned == 0) {
+        s->st.spawned = now_ns();
+    }
+    if (g.opt.timeout != 0) {
+        timer_set(&s->t_prompt, g.opt.timeout);
+    }
+
+    /* one byte before buf for the TIOCPKT status, see pty_read() */
+    if ((s->buf = malloc(BUFFSIZE + 1)) == NULL) {
+        fatal_sys("malloc");
+    }
+    ++s->buf;
+    if (g.fallback_rules != 0 && (s->cache = malloc(2 * BUFFSIZE + 1)) == NULL) {
+        fatal_sys("malloc");
+    }
+    /* kept over --supervise restarts, a failed run's tail is written out */
+    if (g.opt.tail > 0 && s->tail == NULL && (s->tail = malloc(g.opt.tail) ) == NULL) {
+        fatal_sys("malloc");
+    }
+    s->ncache = 0;
+    matcher_reset(&s->mstate);
+    rules_update(s);
+
+    if (g.fleet && ! g.lib.on) {
+        /* room for the "host: " prefix */
+        s->nline = strlen(s->label) + 2;
+        if ((s->line = malloc(s->nline + BUFFSIZE)) == NULL) {
+            fatal_sys("malloc");
+        }
+        sprintf(s->line, "%s: ", s->label);
+    }
+
+    ++g.nrunning;
+
+    /*
+     * wait for the child to open the pty
+     *
+     * On Mac, fcntl(O_NONBLOCK) may fail before the child opens the pty
+     * slave side. So wait a while for the child to open the pty slave.
+     * In fleet mode that's left to the event loop so the other sessions
+     * are not held up.
+     */
+    ev_add(s->fd_ptym, EV_WRITE, s);
+    if (g.fleet) {
+        s->opening = true;
+        timer_set(&s->t_open, OPEN_TIMEOUT);
+        return;
+    }
+    if (! fd_wait(s->fd_ptym, EV_WRITE, OPEN_TIMEOUT) ) {
+        fatal(ERROR_GENERAL, "failed to wait for ptym to be writable");
+    }
+    session_opened(s);
+}
+
+/*
+ * Copy the child's output to stdout and the -L log. In fleet mode every
+ * line is prefixed with the host so the output of concurrent sessions does
+ * not get mixed up.
+ */
+void
+session_output(struct session *s, char *buf, int len)
+{
+    int prefix, n;
+    char *nl;
+
+    tail_put(s, buf, len);
+    rec_put(s, REC_OUTPUT, buf, len);
+    if (g.lib.cb.output != NULL) {
+        g.lib.cb.output((passh_session *) s, buf, len, s->arg);
+        return;
+    }
+    if (! g.fleet) {
+        out_write(OUT_STDOUT, buf, len);
+        out_write(OUT_FROM_PTY, buf, len);
+        return;
+    }
+
+    out_write(OUT_FROM_PTY, buf, len);
+
+    prefix = strlen(s->label) + 2;
+    while (len > 0) {
+        nl = memchr(buf, '\n', len);
+        n = nl != NULL ? nl - buf + 1 : len;
+        if (s->nline - prefix + n > BUFFSIZE) {
+            n = BUFFSIZE - (s->nline - prefix);
+        }
+        memcpy(s->line + s->nline, buf, n);
+        s->nline += n;
+        buf += n;
+        len -= n;
+
+        if (s->line[s->nline - 1] == '\n' || s->nline - prefix == BUFFSIZE) {
+            out_write(OUT_STDOUT, s->line, s->nline);
+            s->nline = prefix;
+        }
+    }
+}
+
+void eof_flushed(struct session *s);
+
+/*
+ * read() from the ptym into s->buf. In packet mode (after EOF on stdin)
+ * every read returns a status byte first, which goes to s->buf[-1] so the
+ * data still starts at s->buf. Status-only packets are handled here.
+ */
+ssize_t
+pty_read(struct session *s, size_t size)
+{
+    ssize_t n;
+
+    if (! s->pktmode) {
+        ++s->st.reads;
+        if ((n = read(s->fd_ptym, s->buf, size) ) > 0) {
+            s->nread += n;
+        }
+        return n;
+    }
+#if defined(TIOCPKT)
+    while (++s->st.reads, (n = read(s->fd_ptym, s->buf - 1, size + 1) ) > 0) {
+        if (s->buf[-1] == TIOCPKT_DATA) {
+            if (n > 1) {
+                s->nread += n - 1;
+                return n - 1;
+            }
+        } else if (s->buf[-1] & TIOCPKT_FLUSHREAD) {
+            eof_flushed(s);
+            if (s->fd_ptym < 0) {
+                /* the child is gone and so is s->buf */
+                return -1;
+            }
+        }
+    }
+    return n;
+#else
+    ++s->st.reads;
+    if ((n = read(s->fd_ptym, s->buf, size) ) > 0) {
+        s->nread += n;
+    }
+    return n;
+#endif
+}
+
+/*
+ * The child has exited but there may be still some data for us to read.
+ */
+void
+session_done(struct session *s, int exit_code)
+{
+    int nread;
+    int prefix;
+#if defined(TIOCPKT)
+    int off = 0;
+
+    /* no more EOF, see eof_start() */
+    if (s->pktmode && s->fd_ptym >= 0 && ioctl(s->fd_ptym, TIOCPKT, &off) == 0) {
+        s->pktmode = false;
+    }
+#endif
+
+    if (s->fd_ptym >= 0) {
+        while ((nread = pty_read(s, BUFFSIZE) ) > 0) {
+            session_output(s, s->buf, nread);
+        }
+        ev_del(s->fd_ptym);
+        close(s->fd_ptym);
+        s->fd_ptym = -1;
+    }
+    s->woff = s->wlen = 0;
+    s->unread = false;
+    s->opening = false;
+    timer_cancel(&s->t_prompt);
+    timer_cancel(&s->t_kill);
+    timer_cancel(&s->t_open);
+    if (s->agent != NULL) {
+        agent_req_free(s->agent);
+    }
+
+    if (g.fleet) {
+        prefix = strlen(s->label) + 2;
+        if (s->nline > prefix) {
+            s->line[s->nline++] = '\n';
+            out_write(OUT_STDOUT, s->line, s->nline);
+        }
+        free(s->line);
+        s->line = NULL;
+    }
+    free(s->buf - 1);
+    free(s->cache);
+    free(s->wbuf);
+    s->buf = s->cache = s->wbuf = NULL;
+    s->wsize = 0;
+
+    if (! s->failed) {
+        s->exit_code = exit_code;
+    }
+    if (s->exit_code != 0) {
+        tail_flush(s, s->exit_code);
+    }
+    if (g.out[OUT_RECORD].fd >= 0) {
+        char code[4];
+
+        rec_le(code, s->exit_code, 4);
+        rec_put(s, REC_EXIT, code, sizeof(code) );
+    }
+    /* e.g. `ssh -f' going to the background after logging in */
+    timer_cancel(&s->t_ready);
+    if (s->exit_code == 0 && s->passwords_seen > 0) {
+        session_ready(s);
+    }
+    event(s, "exited", "\"code\":%d,\"failed\":%s,\"bytes\":%llu,\"restarts\":%d",
+          s->exit_code, s->failed ? "true" : "false", s->nread, s->restarts);
+    s->state = SESS_DONE;
+    --g.nrunning;
+}
+
+/*
+ * What wait4() said about the child of `s'.
+ */
+void
+session_reaped(struct session *s, int status, struct rusage *ru)
+{
+    if (WIFEXITED(status) || WIFSIGNALED(status) ) {
+        timeradd(&s->st.utime, &ru->ru_utime, &s->st.utime);
+        timeradd(&s->st.stime, &ru->ru_stime, &s->st.stime);
+        pid_del(s);
+    }
+    if (WIFEXITED(status) ) {
+        session_done(s, WEXITSTATUS(status) );
+        if (g.opt.supervise) {
+            session_supervise(s);
+        }
+    } else if (WIFSIGNALED(status) ) {
+        session_done(s, status + 128);
+        if (g.opt.supervise) {
+            session_supervise(s);
+        }
+    } else if (WIFSTOPPED(status) ) {
+        /* Do nothing. Just wait for the child to be continued and wait
+         * for the next SIGCHLD. */
+        event(s, "stopped", "\"signal\":%d", WSTOPSIG(status) );
+    } else if (WIFCONTINUED(status) ) {
+        event(s, "continued", NULL);
+    } else {
+        /* This should not happen. */
+        session_done(s, -1);
+    }
+}
+
+/*
+ * Collect the status of every running child which has changed state. Each
+ * child is waited for by its own pid so we never steal other processes
+ * (the library's caller may have children of its own).
+ */
+void
+reap_children(void)
+{
+    pid_t wait_return;
+    int i, status;
+    struct session *s;
+    struct rusage ru;
+#if defined(__linux__)
+    siginfo_t info;
+#endif
+
+    /*
+     * NOTE:
+     *  - WCONTINUED does not work on macOS (10.12.5)
+     *  - On macOS, SIGCHLD can be generated when
+     *     1. child process has terminated/exited
+     *     2. the currently *running* child process is stopped (e.g. by `kill -STOP')
+     *  - On Linux, SIGCHLD can be generated when
+     *     1. child process has terminated/exited
+     *     2. the currently *running* child process is stopped (e.g. by `kill -STOP')
+     *     3. the currently *stopped* child process is continued (e.g. by `kill -CONT')
+     *  - waitpid(WCONTINUED) works on Linux but not on macOS.
+     */
+
+#if defined(__linux__)
+    /*
+     * Ask which child has changed state without collecting it (WNOWAIT)
+     * and then wait for that pid, so one SIGCHLD costs a hash lookup per
+     * child rather than a wait4() per session. A child that's not a
+     * session's (e.g. a --reuse helper) is only waited for outside of the
+     * library.
+     */
+    while (true) {
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* ECHILD */
+            return;
+        }
+        if (info.si_pid == 0) {
+            return;
+        }
+        if ((s = session_by_pid(info.si_pid) ) == NULL && g.lib.on) {
+            break;
+        }
+        while ((wait_return = wait4(info.si_pid, &status, WNOHANG | WUNTRACED | WCONTINUED,
+                                    &ru) ) < 0 && errno == EINTR)
+            ;
+        if (wait_return <= 0) {
+            break;
+        }
+        if (s != NULL && s->state == SESS_RUNNING) {
+            session_reaped(s, status, &ru);
+        } else if (WIFEXITED(status) || WIFSIGNALED(status) ) {
+            if (s != NULL) {
+                /* e.g. session_done(s, -1) by eof_send() */
+                pid_del(s);
+            } else {
+                reuse_reaped(info.si_pid, status);
+            }
+        }
+    }
+#else
+    reuse_reap();
+#endif
+
+    for (i = 0; i < g.nstarted; ++i) {
+        s = g.sessions[i];
+        while (s->state == SESS_RUNNING) {
+            wait_return = wait4(s->pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru);
+            if (wait_return == 0) {
+                break;
+            } else if (wait_return < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fatal_sys("received SIGCHLD but waitpid() failed");
+            }
+            session_reaped(s, status, &ru);
+        }
+    }
+}
+
+/*
+ * Propagate our window size to the child.
+ */
+void
+session_winch(struct session *s)
+{
+    struct winsize ttysize;
+    static int ourtty = -1;
+
+    if (ourtty < 0) {
+#if 0
+        ourtty = open("/dev/tty", 0);
+#else
+        ourtty = STDIN_FILENO;
+#endif
+    }
+    if (s->state == SESS_RUNNING
+        && ioctl(ourtty, TIOCGWINSZ, &ttysize) == 0) {
+        ioctl(s->fd_ptym, TIOCSWINSZ, &ttysize);
+    }
+}
+
+/*
+ * Read the pending signals from g.fd_signal.
+ */
+void
+sig_read(bool *chld, bool *winch)
+{
+#if defined(__linux__)
+    struct signalfd_siginfo si;
+
+    while (read(g.fd_signal, &si, sizeof(si) ) == sizeof(si) ) {
+        *chld |= si.ssi_signo == SIGCHLD;
+        *winch |= si.ssi_signo == SIGWINCH;
+    }
+#else
+    unsigned char sigs[64];
+    ssize_t i, n;
+
+    while ((n = read(g.fd_signal, sigs, sizeof(sigs) ) ) > 0) {
+        for (i = 0; i < n; ++i) {
+            *chld |= sigs[i] == SIGCHLD;
+            *winch |= sigs[i] == SIGWINCH;
+        }
+    }
+#endif
+}
+
+void
+sig_dispatch(void)
+{
+    bool chld = false, winch = false;
+
+    sig_read(&chld, &winch);
+    if (chld) {
+        reap_children();
+    }
+    if (winch && g.stdin_is_tty) {
+        session_winch(g.sessions[0]);
+    }
+}
+
+/*
+ * Send the password and a CR, which the -l log gets as `********'.
+ * Returns false if the session has failed.
+ */
+bool
+password_send(struct session *s)
+{
+    if (! pty_send(s, s->password, strlen(s->password) )
+        || ! pty_send(s, "\r", 1) ) {
+        return false;
+    }
+    out_write(OUT_TO_PTY, "********\r", strlen("********\r") );
+    if (g.opt.tail_input) {
+        tail_put(s, "********\r", strlen("********\r") );
+    }
+    rec_put(s, REC_SENT, "********\r", strlen("********\r") );
+    return true;
+}
+
+/*
+ * Answer a password prompt matched by rule `i' (-1: the `password' command
+ * of --control). With `-p agent:' it's done once the agent has replied.
+ */
+void
+password_answer(struct session *s, int i)
+{
+    if (s->password == NULL && g.opt.agent_sock != NULL) {
+        agent_ask(s, i);
+        return;
+    }
+    if (s->password == NULL) {
+        s->password = g.opt.password;
+    }
+    if (! password_send(s) ) {
+        return;
+    }
+    if (i < 0) {
+        event(s, "password", "\"rule\":-1");
+        return;
+    }
+    if (g.opt.stats) {
+        stats_latency(s);
+    }
+    event(s, "password", "\"rule\":%d", i);
+    if (g.opt.ready_after > 0 && ! s->ready) {
+        timer_set(&s->t_ready, g.opt.ready_after);
+    }
+}
+
+void replay_fire(struct session *s, int i);
+
+/*
+ * Answer the prompt matched by rule `i'.
+ */
+void
+rule_fire(struct session *s, int i)
+{
+    struct rule *rule = &g.rules[i];
+
+    ++s->counts[i];
+    if (g.opt.replay != NULL) {
+        replay_fire(s, i);
+        return;
+    }
+    event(s, "prompt", "\"rule\":%d,\"count\":%d", i, s->counts[i]);
+    if (rule->ready) {
+        session_ready(s);
+        rules_update(s);
+        return;
+    }
+    if (i == g.rule_prompt) {
+        ++s->passwords_seen;
+        if (g.opt.timeout != 0) {
+            timer_set(&s->t_prompt, g.opt.timeout);
+        }
+    }
+
+    if (rule->fatal_more && rule->max != 0 && s->counts[i] > rule->max) {
+        if (i == g.rule_prompt) {
+            session_fatal(s, ERROR_MAX_TRIES, "still prompted for passwords after %d tries", rule->max);
+        } else {
+            session_fatal(s, ERROR_MAX_TRIES, "still prompted for `%s' after %d times", rule->pattern, rule->max);
+        }
+        return;
+    }
+
+    if (rule->response == NULL) {
+        password_answer(s, i);
+    } else {
+        pty_write(s, rule->response, strlen(rule->response) );
+        event(s, i == g.rule_yesno ? "yesno" : "response", "\"rule\":%d", i);
+    }
+
+    rules_update(s);
+}
+
+/*
+ * Match the rules which are not supported by the matcher, with regexec()
+ * against the current (last) line of output. A prompt is always on the
+ * last line so what's before the last newline is never matched again.
+ */
+void
+fallback_match(struct session *s, char *buf, int len)
+{
+    regmatch_t re_match[1];
+    char *nl;
+    int i, n, flags;
+
+    while (len > 0 && s->fd_ptym >= 0 && ! s->given_up) {
+        nl = memchr(buf, '\n', len);
+        n = nl != NULL ? nl - buf : len;
+
+        /* keep at most the last BUFFSIZE bytes of a very long line */
+        if (n > BUFFSIZE) {
+            buf += n - BUFFSIZE;
+            len -= n - BUFFSIZE;
+            n = BUFFSIZE;
+        }
+        if (s->ncache + n > 2 * BUFFSIZE) {
+            memmove(s->cache, s->cache + s->ncache - BUFFSIZE, BUFFSIZE);
+            s->ncache = BUFFSIZE;
+        }
+
+#if defined(REG_STARTEND)
+        /* the length is passed in re_match[0] so NULLs are fine */
+        memcpy(s->cache + s->ncache, buf, n);
+        s->ncache += n;
+#else
+        /* regexec() does not like NULLs */
+        for (i = 0; i < n; ++i) {
+            s->cache[s->ncache++] = buf[i] != 0 ? buf[i] : 0xff;
+        }
+        /* make it NULL-terminated so regexec() would be happy */
+        s->cache[s->ncache] = 0;
+#endif
+
+        /* `$' does not match if the line is already complete */
+        flags = nl != NULL ? REG_NOTEOL : 0;
+        for (i = 0; i < g.nrules && s->ncache > 0; ++i) {
+            if (! (g.fallback_rules & s->enabled & (uint64_t) 1 << i) ) {
+                continue;
+            }
+#if defined(REG_STARTEND)
+            ++s->st.regexecs;
+            re_match[0].rm_so = 0;
+            re_match[0].rm_eo = s->ncache;
+            if (regexec(&g.rules[i].re, s->cache, 1, re_match, flags | REG_STARTEND) != 0) {
+                continue;
+            }
+#else
+            ++s->st.regexecs;
+            if (regexec(&g.rules[i].re, s->cache, 1, re_match, flags) != 0) {
+                continue;
+            }
+#endif
+            s->ncache -= re_match[0].rm_eo;
+            memmove(s->cache, s->cache + re_match[0].rm_eo, s->ncache + 1);
+            rule_fire(s, i);
+            break;
+        }
+
+        if (nl != NULL) {
+            s->ncache = 0;
+            ++n;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * match the prompts and answer them
+ */
+void
+session_match(struct session *s, char *buf, int len)
+{
+    int n, rule;
+    char *p = buf;
+    int left = len;
+    int64_t t0 = g.opt.stats ? now_ns() : 0;
+
+    while (left > 0 && s->fd_ptym >= 0 && ! s->given_up) {
+        n = matcher_feed(&s->mstate, p, left, s->enabled, &rule);
+        ++s->st.matches;
+        p += n;
+        left -= n;
+        if (rule >= 0) {
+            rule_fire(s, rule);
+        }
+    }
+    if (left == 0 && s->fd_ptym >= 0 && ! s->given_up
+        && (rule = matcher_eol(&s->mstate, s->enabled) ) >= 0) {
+        rule_fire(s, rule);
+    }
+    if (g.opt.stats) {
+        s->st.match_time += now_ns() - t0;
+    }
+
+    if (g.fallback_rules != 0) {
+        t0 = g.opt.stats ? now_ns() : 0;
+        fallback_match(s, buf, len);
+        if (g.opt.stats) {
+            s->st.regexec_time += now_ns() - t0;
+        }
+    }
+}
+
+/*
+ * No more prompts to answer (the user has started typing, or all rules are
+ * done): switch to a plain relay with a bigger buffer and no per-read
+ * matching or time() calls.
+ */
+void
+passthru_start(struct session *s)
+{
+    char *buf;
+
+    if ((buf = realloc(s->buf - 1, RELAY_BUFFSIZE + 1)) == NULL) {
+        fatal_sys("realloc");
+    }
+    s->buf = buf + 1;
+    s->passthru = true;
+
+    free(s->cache);
+    s->cache = NULL;
+    s->ncache = 0;
+}
+
+/*
+ * copy data from ptym to stdout, the fast way
+ */
+void
+passthru_relay(struct session *s)
+{
+    struct outq *q = &g.out[OUT_STDOUT];
+    ssize_t nread;
+    int budget = RELAY_BUDGET;
+
+#if defined(__linux__)
+    /* Only with nothing queued or the output would be reordered. */
+    while (g.splice_ok && q->len == 0 && ! s->pktmode && s->fd_ptym >= 0) {
+        if (out_full() ) {
+            g.out_paused = true;
+            return;
+        }
+        if (budget-- == 0) {
+            s->unread = true;
+            return;
+        }
+        ++s->st.reads;
+        nread = splice(s->fd_ptym, NULL, q->fd, NULL, RELAY_BUFFSIZE,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (nread > 0) {
+            s->nread += nread;
+            ++q->writes;
+            q->nwritten += nread;
+            continue;
+        } else if (nread < 0 && errno == EINTR) {
+            continue;
+        } else if (nread < 0 && (errno == EINVAL || errno == ENOSYS) ) {
+            /* the tty driver cannot splice, never try again */
+            g.splice_ok = false;
+            break;
+        } else if (nread < 0 && errno != EAGAIN && errno != EIO) {
+            fatal_sys("splice: fd %d", s->fd_ptym);
+        }
+        /* EAGAIN from either side (or EIO if the child exited). If it's
+         * stdout being full wait for it to be writable. */
+        if (nread < 0 && errno == EAGAIN && ! fd_wait(q->fd, EV_WRITE, 0) ) {
+            q->stalled = true;
+            out_watch(q, true);
+            g.out_paused = true;
+        }
+        return;
+    }
+#endif
+
+    while (s->fd_ptym >= 0) {
+        if (out_full() ) {
+            g.out_paused = true;
+            return;
+        }
+        if (budget-- == 0) {
+            s->unread = true;
+            return;
+        }
+        nread = pty_read(s, RELAY_BUFFSIZE);
+        if (nread <= 0) {
+            return;
+        }
+        out_write(OUT_STDOUT, s->buf, nread);
+        out_write(OUT_FROM_PTY, s->buf, nread);
+        tail_put(s, s->buf, nread);
+        rec_put(s, REC_OUTPUT, s->buf, nread);
+    }
+}
+
+/*
+ * copy data from ptym to stdout
+ */
+void
+session_relay(struct session *s)
+{
+    int nread;
+    int budget = RELAY_BUDGET;
+
+    s->unread = false;
+    while (s->fd_ptym >= 0) {
+        if (s->passthru) {
+            passthru_relay(s);
+            return;
+        }
+        if (out_full() ) {
+            g.out_paused = true;
+            return;
+        }
+        /* The ptys are edge-triggered. A child writing faster than we
+         * read would keep us here forever, so stop after a while and let
+         * big_loop() call us again. */
+        if (budget-- == 0) {
+            s->unread = true;
+            return;
+        }
+
+        nread = pty_read(s, BUFFSIZE);
+        if (nread <= 0) {
+            /* EAGAIN, or EIO if the child exited */
+            return;
+        }
+        if (g.opt.stats) {
+            s->st.read_at = now_ns();
+            if (s->st.first_output == 0) {
+                s->st.first_output = s->st.read_at;
+            }
+        }
+
+        session_output(s, s->buf, nread);
+
+        if (! s->now_interactive && ! s->given_up) {
+            session_match(s, s->buf, nread);
+        }
+        /* fleet mode output is prefixed line by line so never pass through */
+        if (! g.fleet && (s->now_interactive || s->given_up) ) {
+            passthru_start(s);
+        }
+    }
+}
+
+/*
+ * An output queue has become writable. Once they're all below the
+ * high-water mark again the ptys are read again (they are edge-triggered
+ * so they must be drained now).
+ */
+void
+out_event(struct outq *q)
+{
+    int i;
+
+    q->stalled = false;
+    out_flush(q);
+    if (q->len == 0) {
+        out_watch(q, false);
+    }
+
+    if (g.out_paused && ! out_full() ) {
+        g.out_paused = false;
+        for (i = 0; i < g.nstarted; ++i) {
+            if (g.sessions[i]->state == SESS_RUNNING && g.sessions[i]->fd_ptym >= 0) {
+                session_relay(g.sessions[i]);
+            }
+        }
+    }
+}
+
+/*
+ * -s: copy stdin to the child's stdin pipe. Only one side is watched at a
+ * time, stdin while the buffer is empty and the pipe while there's data
+ * left to write. So a child not reading its stdin stops us from reading
+ * (and the writer of our stdin blocks) rather than piling data up here.
+ */
+void
+input_watch(int fd, int events)
+{
+    if (g.in.watch == fd) {
+        return;
+    }
+    if (g.in.watch >= 0) {
+        ev_del(g.in.watch);
+    }
+    ev_add(fd, events, fd == STDIN_FILENO ? NULL : &g.in.fd);
+    g.in.watch = fd;
+}
+
+void
+input_close(void)
+{
+    if (g.in.watch >= 0) {
+        ev_del(g.in.watch);
+        g.in.watch = -1;
+    }
+    if (g.in.fd >= 0) {
+        close(g.in.fd);
+        g.in.fd = -1;
+    }
+}
+
+/*
+ * Regular files, /dev/null and the like cannot be watched (epoll refuses
+ * them) but never block either, so they are read whenever the pipe is
+ * writable. At most one buffer is read per call to keep the pty served.
+ */
+void
+input_pump(bool readable)
+{
+    ssize_t n;
+
+    while (g.in.fd >= 0) {
+        if (g.in.len == 0 && g.in.eof) {
+            /* the child gets EOF */
+            input_close();
+            return;
+        }
+        if (g.in.len == 0) {
+            if (! readable) {
+                if (g.in.pollable) {
+                    input_watch(STDIN_FILENO, EV_READ);
+                } else {
+                    input_watch(g.in.fd, EV_WRITE);
+                }
+                return;
+            }
+            readable = false;
+            n = read(STDIN_FILENO, g.in.buf, RELAY_BUFFSIZE);
+            if (n < 0 && (errno == EINTR || errno == EAGAIN) ) {
+                continue;
+            } else if (n < 0) {
+                fatal_sys("read error from stdin");
+            } else if (n == 0) {
+                g.in.eof = true;
+                continue;
+            }
+            g.in.off = 0;
+            g.in.len = n;
+        }
+
+        n = write(g.in.fd, g.in.buf + g.in.off, g.in.len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            input_watch(g.in.fd, EV_WRITE);
+            return;
+        } else if (n < 0) {
+            /* EPIPE: the child has closed its stdin or exited */
+            input_close();
+            return;
+        }
+        g.in.off += n;
+        g.in.len -= n;
+    }
+}
+
+/*
+ * Send EOF to the child
+ *  - See http://lists.gnu.org/archive/html/help-bash/2016-11/msg00002.html
+ *    (EOF ('\004') was lost if it's sent to bash too quickly)
+ *  - We cannot simply close(fd_ptym) or the child will get SIGHUP.
+ */
+void
+eof_send(struct session *s)
+{
+    struct termios term;
+    char eof_char;
+
+    if (s->state != SESS_RUNNING || s->fd_ptym < 0) {
+        return;
+    }
+    if (tcgetattr(s->fd_ptym, &term) < 0) {
+        session_done(s, -1);
+        return;
+    }
+    eof_char = term.c_cc[VEOF];
+    /* after the input still queued; on EAGAIN it's resent later anyway */
+    if (s->wlen > 0) {
+        return;
+    }
+    if (write(s->fd_ptym, &eof_char, 1) < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            session_done(s, -1);
+        }
+        return;
+    }
+    out_write(OUT_TO_PTY, &eof_char, 1);
+    rec_put(s, REC_SENT, &eof_char, 1);
+}
+
+/*
+ * EOF on stdin. The EOF is sent right away. It's lost when the child
+ * flushes its input (e.g. tcsetattr(TCSAFLUSH) when bash starts) so the
+ * ptym is put in packet mode, which tells us about flushes, and it's
+ * sent again at once then. As not all systems report them it's also
+ * resent with backoff until the child exits.
+ */
+void
+eof_start(struct session *s)
+{
+#if defined(TIOCPKT)
+    int on = 1;
+
+    if (s->fd_ptym >= 0 && ioctl(s->fd_ptym, TIOCPKT, &on) == 0) {
+        s->pktmode = true;
+    }
+#endif
+    g.eof_delay = EOF_INTERVAL;
+    timer_set(&g.t_eof, g.eof_delay);
+    eof_send(s);
+}
+
+void
+eof_flushed(struct session *s)
+{
+    g.eof_delay = EOF_INTERVAL;
+    timer_set(&g.t_eof, g.eof_delay);
+    eof_send(s);
+}
+
+void
+eof_resend(struct timer *t)
+{
+    struct session *s = t->arg;
+
+    if (s->state != SESS_RUNNING || s->fd_ptym < 0) {
+        return;
+    }
+    if ((g.eof_delay *= 2) > EOF_MAX_INTERVAL) {
+        g.eof_delay = EOF_MAX_INTERVAL;
+    }
+    timer_set(t, g.eof_delay);
+    eof_send(s);
+}
+
+/*
+ * --control: one command per connection, served by the event loop. The
+ * reply is `+' and what the command has to say, or `-<error>', and then
+ * the connection is closed. See ctl_command().
+ */
+struct ctl_client {
+    int fd;
+    char req[CTL_REQ_MAX + 1];
+    int len;
+    char *reply;                /* NULL till the request has been read */
+    size_t off;
+    size_t size;
+    struct ctl_client *next;
+};
+
+static struct {
+    int fd;                     /* listening */
+    char *path;
+    struct ctl_client *clients;
+} ctl = { .fd = -1 };
+
+void
+ctl_close(struct ctl_client *c)
+{
+    struct ctl_client **pp;
+
+    for (pp = &ctl.clients; *pp != c; pp = &(*pp)->next)
+        ;
+    *pp = c->next;
+
+    ev_del(c->fd);
+    close(c->fd);
+    free(c->reply);
+    free(c);
+}
+
+/*
+ * Write the reply until the socket would block.
+ */
+void
+ctl_flush(struct ctl_client *c)
+{
+    ssize_t n;
+
+    while (c->off < c->size) {
+        n = write(c->fd, c->reply + c->off, c->size - c->off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            ev_mod(c->fd, EV_WRITE, c);
+            return;
+        } else if (n < 0) {
+            break;
+        }
+        c->off += n;
+    }
+    ctl_close(c);
+}
+
+/*
+ * Reopen the -l/-L logs by their names, e.g. after logrotate(8) has renamed
+ * them. The new file takes the place of the old one with dup2() so the log
+ * thread just goes on writing to the same fd; what's still in its ring
+ * goes to the new file.
+ */
+bool
+log_reopen(FILE *reply)
+{
+    static const int logs[] = { OUT_TO_PTY, OUT_FROM_PTY };
+    struct outq *q;
+    char *path;
+    int i, fd;
+
+    for (i = 0; i < 2; ++i) {
+        q = &g.out[logs[i]];
+        path = logs[i] == OUT_TO_PTY ? g.opt.log_to_pty : g.opt.log_from_pty;
+        if (path == NULL || q->fd < 0) {
+            continue;
+        }
+        /* appended to, in case it has not been renamed */
+        if ((fd = open(path, O_CREAT | O_WRONLY | O_APPEND, 0600) ) < 0
+            || dup2(fd, q->fd) < 0) {
+            fprintf(reply, "-%s: %s\n", path, strerror(errno) );
+            if (fd >= 0) {
+                close(fd);
+            }
+            return false;
+        }
+        close(fd);
+        fcntl(q->fd, F_SETFD, FD_CLOEXEC);
+    }
+    return true;
+}
+
+/*
+ *  stats               what --stats-file would write
+ *  password [<host>]   send the password again, to all the sessions
+ *                      without a <host>
+ *  rotate              reopen the -l/-L logs
+ *  log on|off          resume or pause the -l/-L logs
+ */
+void
+ctl_command(struct ctl_client *c)
+{
+    char *cmd = c->req, *arg;
+    struct session *s;
+    FILE *fp;
+    int i, n;
+
+    if ((fp = open_memstream(&c->reply, &c->size) ) == NULL) {
+        fatal_sys("open_memstream");
+    }
+    cmd[strcspn(cmd, "\r")] = '\0';
+    arg = cmd + strcspn(cmd, " ");
+    if (*arg != '\0') {
+        *arg++ = '\0';
+    }
+
+    if (strcmp(cmd, "stats") == 0) {
+        fprintf(fp, "+\n");
+        stats_prom(fp);
+    } else if (strcmp(cmd, "password") == 0) {
+        for (n = 0, i = 0; i < g.nstarted; ++i) {
+            s = g.sessions[i];
+            if (s->state != SESS_RUNNING || s->fd_ptym < 0
+                || (*arg != '\0' && strcmp(arg, s->label) != 0) ) {
+                continue;
+            }
+            password_answer(s, -1);
+            ++n;
+        }
+        if (n > 0) {
+            fprintf(fp, "+%d\n", n);
+        } else {
+            fprintf(fp, "-no such session\n");
+        }
+    } else if (strcmp(cmd, "rotate") == 0) {
+        if (log_reopen(fp) ) {
+            fprintf(fp, "+\n");
+        }
+    } else if (strcmp(cmd, "log") == 0
+               && (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0) ) {
+        g.out[OUT_TO_PTY].paused = g.out[OUT_FROM_PTY].paused = strcmp(arg, "off") == 0;
+        fprintf(fp, "+\n");
+    } else {
+        fprintf(fp, "-unknown command: %s\n", cmd);
+    }
+
+    if (fclose(fp) != 0) {
+        fatal_sys("open_memstream");
+    }
+}
+
+void
+ctl_read(struct ctl_client *c)
+{
+    char *nl;
+    int nread;
+
+    nread = read(c->fd, c->req + c->len, CTL_REQ_MAX - c->len);
+    if (nread < 0 && (errno == EINTR || errno == EAGAIN) ) {
+        return;
+    }
+    if (nread <= 0) {
+        ctl_close(c);
+        return;
+    }
+    c->len += nread;
+    c->req[c->len] = '\0';
+
+    if ((nl = strchr(c->req, '\n')) != NULL) {
+        *nl = '\0';
+    } else if (c->len < CTL_REQ_MAX) {
+        return;
+    }
+    ctl_command(c);
+    ctl_flush(c);
+}
+
+/*
+ * Whether it's an event of the control socket or one of its clients (which
+ * may have been closed already by an earlier event of the batch).
+ */
+bool
+ctl_event(void *data)
+{
+    struct ctl_client *c;
+    int fd;
+
+    if (data == &ctl.fd) {
+        while ((fd = accept(ctl.fd, NULL, NULL)) >= 0) {
+            if ((c = calloc(1, sizeof(*c))) == NULL) {
+                fatal_sys("calloc");
+            }
+            c->fd = fd;
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            c->next = ctl.clients;
+            ctl.clients = c;
+            ev_add(fd, EV_READ, c);
+        }
+        return true;
+    }
+    for (c = ctl.clients; c != NULL; c = c->next) {
+        if (c == data) {
+            if (c->reply != NULL) {
+                ctl_flush(c);
+            } else {
+                ctl_read(c);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+ctl_atexit(void)
+{
+    if (getpid() == g.pid) {
+        unlink(ctl.path);
+    }
+}
+
+void
+ctl_open(char *path)
+{
+    ctl.path = path;
+    ctl.fd = unix_listen(path);
+    fcntl(ctl.fd, F_SETFL, fcntl(ctl.fd, F_GETFL) | O_NONBLOCK);
+    ev_add(ctl.fd, EV_READ, &ctl.fd);
+    if (atexit(ctl_atexit) < 0) {
+        fatal_sys("atexit error");
+    }
+}
+
+/*
+ * One round of the event loop: run the due timers, then wait at most
+ * `timeout' ms (-1: till the next timer) for events and handle them.
+ */
+void
+loop_once(int timeout)
+{
+    char buf1[BUFFSIZE];          /* for read() from stdin */
+    struct session *s;
+    int nread;
+    struct ev_event events[EV_MAXEVENTS];
+    int i, j, n;
+
+    timer_run();
+    if (g.nrunning == 0 && g.nrestarting == 0) {
+        return;
+    }
+
+    n = timer_timeout();
+    if (timeout < 0 || (n >= 0 && n < timeout) ) {
+        timeout = n;
+    }
+    for (i = 0; i < g.nstarted; ++i) {
+        s = g.sessions[i];
+        if (s->unread && s->state == SESS_RUNNING && s->fd_ptym >= 0
+            && ! g.out_paused) {
+            session_relay(s);
+        }
+        if (s->unread && s->state == SESS_RUNNING && ! g.out_paused) {
+            timeout = 0;
+        }
+    }
+
+    n = ev_wait(events, EV_MAXEVENTS, timeout);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return;
+        } else {
+            fatal_sys("event wait error");
+        }
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (events[i].data == &g.fd_signal) {
+            sig_dispatch();
+            continue;
+        }
+        for (j = 0; j < NOUTS; ++j) {
+            if (events[i].data == &g.out[j]) {
+                out_event(&g.out[j]);
+                break;
+            }
+        }
+        if (j < NOUTS) {
+            continue;
+        }
+        if (events[i].data == &g.in.fd) {
+            input_pump(! g.in.pollable);
+            continue;
+        } else if (events[i].data == NULL && ! g.stdin_is_tty) {
+            if (g.in.watch == STDIN_FILENO) {
+                input_pump(true);
+            }
+            continue;
+        } else if (ctl.fd >= 0 && ctl_event(events[i].data) ) {
+            continue;
+        } else if (agent_reqs != NULL && agent_event(events[i].data) ) {
+            continue;
+        } else if (reuse_jobs != NULL && reuse_event(events[i].data) ) {
+            continue;
+        } else if (events[i].data != NULL) {
+            s = events[i].data;
+            if (s->opening && s->state == SESS_RUNNING && s->fd_ptym >= 0) {
+                session_opened(s);
+            } else if (s->wlen > 0 && s->state == SESS_RUNNING && s->fd_ptym >= 0) {
+                pty_flush(s);
+            }
+            if (s->state == SESS_RUNNING && s->fd_ptym >= 0) {
+                session_relay(s);
+            }
+            continue;
+        }
+
+        /*
+         * copy data from stdin to ptym
+         */
+        s = g.sessions[0];
+        if ((nread = read(STDIN_FILENO, buf1, BUFFSIZE)) < 0)
+            fatal_sys("read error from stdin");
+        else if (nread == 0) {
+            /* EOF on stdin means we're done */
+            ev_del(STDIN_FILENO);
+            eof_start(s);
+        } else if (s->state == SESS_RUNNING && s->fd_ptym >= 0) {
+            s->now_interactive = true;
+            pty_write(s, buf1, nread);
+        }
+    }
+}
+
+void
+big_loop()
+{
+    struct session *s;
+    int i, r, fd;
+    int exit_code;
+#if defined(__linux__)
+    struct stat st;
+#endif
+
+    if (g.opt.log_to_pty != NULL) {
+        fd = open(g.opt.log_to_pty, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+        if (fd < 0) {
+            fatal_sys("open: %s", g.opt.log_to_pty);
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        log_open(OUT_TO_PTY, fd, g.opt.log_to_pty);
+    }
+    if (g.opt.log_from_pty != NULL) {
+        fd = open(g.opt.log_from_pty, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+        if (fd < 0) {
+            fatal_sys("open: %s", g.opt.log_from_pty);
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        log_open(OUT_FROM_PTY, fd, g.opt.log_from_pty);
+    }
+    out_open(OUT_STDOUT, STDOUT_FILENO, "stdout");
+    if (atexit(out_atexit) < 0) {
+        fatal_sys("atexit error");
+    }
+    log_start();
+
+#if defined(__linux__)
+    /* splice() needs a pipe on one end and cannot copy to the logs too */
+    if (! g.fleet && g.out[OUT_FROM_PTY].fd < 0 && g.opt.tail == 0
+        && g.opt.record == NULL && g.out[OUT_STDOUT].async
+        && fstat(g.out[OUT_STDOUT].fd, &st) == 0 && S_ISFIFO(st.st_mode) ) {
+        g.splice_ok = true;
+    }
+#endif
+
+    timer_init(&g.t_eof, eof_resend, g.sessions[0]);
+    if (g.stdin_is_tty) {
+        /* level-triggered: a tty shared with others must stay blocking */
+        ev_add(STDIN_FILENO, EV_READ, NULL);
+    } else if (g.in.fd >= 0) {
+        input_pump(false);
+    }
+
+    while (true) {
+        while (g.nstarted < g.nsessions
+               && (g.opt.jobs <= 0 || g.nrunning < g.opt.jobs) ) {
+            session_start(g.sessions[g.nstarted++]);
+        }
+        if (g.nrunning == 0 && g.nrestarting == 0) {
+            break;
+        }
+        loop_once(-1);
+    }
+
+    out_drain(-1);
+    log_stop();
+    if (g.out[OUT_TO_PTY].fd >= 0) {
+        close(g.out[OUT_TO_PTY].fd);
+        g.out[OUT_TO_PTY].fd = -1;
+    }
+    if (g.out[OUT_FROM_PTY].fd >= 0) {
+        close(g.out[OUT_FROM_PTY].fd);
+        g.out[OUT_FROM_PTY].fd = -1;
+    }
+    if (g.out[OUT_RECORD].fd >= 0) {
+        close(g.out[OUT_RECORD].fd);
+        g.out[OUT_RECORD].fd = -1;
+    }
+
+    if (! g.fleet) {
+        exit_code = g.sessions[0]->exit_code;
+        exit(exit_code < 0 ? ERROR_GENERAL : exit_code);
+    }
+
+    /* fleet mode: report the failed hosts and exit with the worst status */
+    exit_code = 0;
+    for (i = 0; i < g.nsessions; ++i) {
+        s = g.sessions[i];
+        r = s->exit_code < 0 ? ERROR_GENERAL : s->exit_code;
+        if (r != 0 && ! s->failed) {
+            fprintf(stderr, "!! %s: exited with %d\r\n", s->label, r);
+        }
+        if (r > exit_code) {
+            exit_code = r;
+        }
+    }
+    exit(exit_code);
+}
+
+/*
+ * --replay: the output of a --record is fed to session_match() as fast as
+ * it can be, with the rules of the options given, and rule_fire() only
+ * notes the matches. What the user typed stops the matching as it did
+ * live, and -t is timed by the recording's clock.
+ */
+struct replay_match {
+    int64_t t;                  /* ns since the start of the recording */
+    unsigned id;
+    int rule;                   /* -1: -t timed out */
+    int count;
+    bool fatal;                 /* passh would have given up here */
+};
+
+struct replay_session {
+    struct session *s;
+    int64_t deadline;           /* -t */
+    FILE *cast;                 /* --asciicast */
+    int64_t cast_t0;
+    char pending[4];            /* an incomplete UTF-8 character */
+    int npending;
+};
+
+static struct {
+    int64_t t;                  /* of the chunk being replayed */
+    uint64_t wall0;             /* us, when the recording started */
+    struct replay_session *sessions;    /* by the recorded id */
+    unsigned nsessions;
+    int nruns;
+    struct replay_match *matches;
+    int nmatches;
+    int nalloc;
+    bool cast_used;
+    char *buf;                  /* for the asciicast lines */
+    size_t size;
+} rp;
+
 void
-tty_atexit(void)
+replay_note(struct session *s, int rule, bool fatal)
 {
-    if (g.reset_on_exit) {
-        tty_reset(STDIN_FILENO, &g.save_termios);
+    struct replay_match *m;
+
+    if (rp.nmatches == rp.nalloc) {
+        rp.nalloc = rp.nalloc ? 2 * rp.nalloc : 64;
+        if ((rp.matches = realloc(rp.matches, rp.nalloc * sizeof(*m) ) ) == NULL) {
+            fatal_sys("realloc");
+        }
     }
+    m = &rp.matches[rp.nmatches++];
+    m->t = rp.t;
+    m->id = s->id;
+    m->rule = rule;
+    m->count = rule >= 0 ? s->counts[rule] : 0;
+    m->fatal = fatal;
 }
 
-ssize_t
-read_if_ready(int fd, char *buf, size_t n)
+/*
+ * rule_fire() without sending anything, see above.
+ */
+void
+replay_fire(struct session *s, int i)
 {
-    struct timeval timeout;
-    fd_set fds;
-    int nread;
-
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
+    struct rule *rule = &g.rules[i];
+    bool fatal = rule->fatal_more && rule->max != 0 && s->counts[i] > rule->max;
 
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
-    if (select(fd + 1, &fds, NULL, NULL, &timeout) < 0) {
-        return -1;
-    }
-    if (! FD_ISSET(fd, &fds) ) {
-        return 0;
+    replay_note(s, i, fatal);
+    if (fatal) {
+        s->given_up = true;
+        return;
     }
-    if ((nread = read(fd, buf, n) ) < 0) {
-        return -1;
+    if (i == g.rule_prompt) {
+        ++s->passwords_seen;
+        rp.sessions[s->id].deadline = rp.t + g.opt.timeout * 1000000LL;
     }
-    return nread;
+    rules_update(s);
 }
 
-ssize_t
-writen(int fd, const void *ptr, size_t n)
+/*
+ * How much of `buf' is whole UTF-8 characters, so an asciicast line never
+ * ends in the middle of one.
+ */
+size_t
+utf8_whole(const char *buf, size_t len)
 {
-    size_t nleft;
-    ssize_t nwritten;
-
-    nleft = n;
-    while (nleft > 0) {
-        if ((nwritten = write(fd, ptr, nleft)) < 0) {
-            if (nleft == n) {
-                return (-1);
-            } else {
-                /* error, return amount written so far */
-                break;
-            }
-        } else if (nwritten == 0) {
+    size_t i;
+    int need;
+
+    for (i = len; i > 0 && len - i < 3; --i) {
+        if (((unsigned char) buf[i - 1] & 0xc0) == 0xc0) {
+            need = (unsigned char) buf[i - 1] >= 0xf0 ? 4
+                : (unsigned char) buf[i - 1] >= 0xe0 ? 3 : 2;
+            return len - (i - 1) < need ? i - 1 : len;
+        } else if (((unsigned char) buf[i - 1] & 0x80) == 0) {
             break;
         }
-        nleft -= nwritten;
-        ptr += nwritten;
     }
-    return (n - nleft);
+    return len;
 }
 
-/*
- * The only portable use of signal() is to set a signal's disposition
- * to SIG_DFL or SIG_IGN.  The semantics when using signal() to
- * establish a signal handler vary across systems (and POSIX.1
- * explicitly  permits  this variation); do not use it for this purpose.
- *
- * POSIX.1 solved the portability mess by specifying sigaction(2),
- * which provides explicit control of the semantics when a signal
- * handler is invoked; use that interface instead of signal().
- *
- * In the original UNIX systems, when a handler that was established
- * using signal() was invoked by the delivery of a signal, the
- * disposition of the signal would be reset to SIG_DFL, and the system
- * did not block delivery of further instances of the signal.  This is
- * equivalent to calling sigaction(2) with the following flags:
- *
- *   sa.sa_flags = SA_RESETHAND | SA_NODEFER;
- */
 void
-sig_handle(int signo, void (*handler)(int) )
+cast_open(struct replay_session *rs, const char *data, size_t len)
 {
-    struct sigaction act;
+    char *path, title[1024];
 
-    memset(&act, 0, sizeof(act) );
-    act.sa_handler = handler;
-    sigaction(signo, &act, NULL);
+    if ((path = str_replace(g.opt.asciicast, "{}", rs->s->label) ) == NULL) {
+        if (rp.cast_used) {
+            fprintf(stderr, "!! %s: --asciicast without `{}', not written\r\n", rs->s->label);
+            return;
+        }
+        path = strdup(g.opt.asciicast);
+    }
+    rp.cast_used = true;
+    if ((rs->cast = fopen(path, "w") ) == NULL) {
+        fatal_sys("open: %s", path);
+    }
+    free(path);
+
+    json_str(title, sizeof(title), rs->s->label);
+    fprintf(rs->cast, "{\"version\": 2, \"width\": %d, \"height\": %d, "
+            "\"timestamp\": %llu, \"title\": %s}\n",
+            rec_get(data, 2) ? (int) rec_get(data, 2) : 80,
+            rec_get(data + 2, 2) ? (int) rec_get(data + 2, 2) : 24,
+            (unsigned long long) (rp.wall0 + rp.t / 1000) / 1000000, title);
+    rs->cast_t0 = rp.t;
 }
 
 void
-sig_child(int signo)
+cast_put(struct replay_session *rs, int type, const char *data, size_t len)
 {
-    g.SIGCHLDed = true;
-}
+    size_t n = rs->npending + len, whole;
 
-void
-sig_winch(int signum)
-{
-    g.received_winch = true;
-    return;
+    if (rs->cast == NULL) {
+        return;
+    }
+    if (7 * n + 4 > rp.size) {
+        rp.size = 7 * n + 4;
+        if ((rp.buf = realloc(rp.buf, rp.size) ) == NULL) {
+            fatal_sys("realloc");
+        }
+    }
+    /* the data goes at the end of the buffer and is quoted to the start */
+    memcpy(rp.buf + rp.size - n, rs->pending, rs->npending);
+    memcpy(rp.buf + rp.size - len, data, len);
+    data = rp.buf + rp.size - n;
+    whole = type == REC_OUTPUT ? utf8_whole(data, n) : n;
+    rs->npending = n - whole;
+    memcpy(rs->pending, data + whole, rs->npending);
+
+    json_strn(rp.buf, 6 * whole + 3, data, whole);
+    fprintf(rs->cast, "[%.6f, \"%c\", %s]\n", (rp.t - rs->cast_t0) / 1e9,
+            type == REC_OUTPUT ? 'o' : 'i', rp.buf);
 }
 
-#define write2(fd1, fd2, buf, len) \
-    do { \
-        int fds[2] = { fd1, fd2 }; \
-        int i; \
-        for (i = 0; i < 2; ++i) { \
-            if (fds[i] < 0) { \
-                continue; \
-            } \
-            if (writen(fds[i], buf, (len) ) != (len) ) { \
-                fatal_sys("write: fd %d", fds[i]); \
-            } \
-        } \
-    } while (0)
 void
-big_loop()
+replay_start(unsigned id, char *data, size_t len)
 {
-    char buf1[BUFFSIZE];          /* for read() from stdin */
-    char buf2[2 * BUFFSIZE + 1];  /* for read() from ptym, `+1' for adding the '\000' */
-    char *cache = buf2;
-    int nread, ncache = 0;
-    struct timeval select_timeout;
-    fd_set readfds;
-    int i, r, status;
-    regmatch_t re_match[1];
-    time_t last_time = time(NULL);
-    bool given_up = false;
-    int passwords_seen = 0;
-    int fd_to_pty = -1, fd_from_pty = -1;
-    bool stdin_eof = false;
-    int exit_code = -1;
-    pid_t wait_return;
+    struct replay_session *rs;
+    struct session *s;
+    char *label;
 
-    if (g.opt.log_to_pty != NULL) {
-        fd_to_pty = open(g.opt.log_to_pty, O_CREAT | O_WRONLY | O_TRUNC, 0600);
-        if (fd_to_pty < 0) {
-            fatal_sys("open: %s", g.opt.log_to_pty);
-        }
+    /* sessions are started in order, so a new one is the next id at most */
+    if (len < 4 || id > rp.nruns) {
+        fatal(ERROR_GENERAL, "%s: bad recording", g.opt.replay);
     }
-    if (g.opt.log_from_pty != NULL) {
-        fd_from_pty = open(g.opt.log_from_pty, O_CREAT | O_WRONLY | O_TRUNC, 0600);
-        if (fd_from_pty < 0) {
-            fatal_sys("open: %s", g.opt.log_from_pty);
+    if (id >= rp.nsessions) {
+        rp.sessions = realloc(rp.sessions, (id + 1) * sizeof(*rs) );
+        if (rp.sessions == NULL) {
+            fatal_sys("realloc");
         }
+        memset(&rp.sessions[rp.nsessions], 0, (id + 1 - rp.nsessions) * sizeof(*rs) );
+        rp.nsessions = id + 1;
     }
+    rs = &rp.sessions[id];
 
-    /*
-     * wait for the child to open the pty
-     */
-    do {
-        /*
-         * On Mac, fcntl(O_NONBLOCK) may fail before the child opens the pty
-         * slave side. So wait a while for the child to open the pty slave.
-         */
-        fd_set writefds;
+    if (rs->s == NULL) {
+        if ((label = strndup(data + 4, len - 4) ) == NULL) {
+            fatal_sys("strndup");
+        }
+        s = rs->s = session_new(label, NULL);
+        s->id = id;
+        if (g.fallback_rules != 0 && (s->cache = malloc(2 * BUFFSIZE + 1)) == NULL) {
+            fatal_sys("malloc");
+        }
+        if (g.opt.asciicast != NULL) {
+            cast_open(rs, data, len);
+        }
+    }
 
-        select_timeout.tv_sec = 1;
-        select_timeout.tv_usec = 0;
+    /* a new run (--supervise) */
+    s = rs->s;
+    memset(s->counts, 0, sizeof(s->counts) );
+    s->passwords_seen = 0;
+    s->given_up = false;
+    s->now_interactive = false;
+    s->ncache = 0;
+    matcher_reset(&s->mstate);
+    rules_update(s);
+    rs->deadline = rp.t + g.opt.timeout * 1000000LL;
+    ++rp.nruns;
+}
 
-        FD_ZERO(&writefds);
-        FD_SET(g.fd_ptym, &writefds);
+void
+replay_report(unsigned long long nout, unsigned long long nmatched, int64_t t_match)
+{
+    unsigned long long calls = 0, regexecs = 0;
+    struct replay_match *m;
+    struct session *s;
+    unsigned i;
+
+    for (m = rp.matches; m < rp.matches + rp.nmatches; ++m) {
+        s = rp.sessions[m->id].s;
+        printf("%12.6f %s: ", m->t / 1e9, s->label);
+        if (m->rule < 0) {
+            printf("timed out (-t)%s\n", m->fatal ? ", exit with 203 (-T)" : "");
+        } else {
+            printf("rule %d `%s' #%d%s\n", m->rule, g.rules[m->rule].pattern,
+                   m->count, m->fatal ? ", exit with 205 (-C)" : "");
+        }
+    }
 
-        select(g.fd_ptym + 1, NULL, &writefds, NULL, &select_timeout);
-        if (! FD_ISSET(g.fd_ptym, &writefds) ) {
-            fatal(ERROR_GENERAL, "failed to wait for ptym to be writable");
+    for (i = 0; i < rp.nsessions; ++i) {
+        if ((s = rp.sessions[i].s) != NULL) {
+            calls += s->st.matches;
+            regexecs += s->st.regexecs;
         }
-    } while (0);
+    }
+    printf("%s: %d sessions, %d runs, %.3fs\n", g.opt.replay, g.nsessions, rp.nruns,
+           rp.t / 1e9);
+    printf("  output %llu bytes, matched %llu in %.3fms (%.1f MB/s)\n", nout, nmatched,
+           t_match / 1e6, t_match > 0 ? nmatched / 1048576.0 / (t_match / 1e9) : 0);
+    printf("  %d matches, %llu matcher_feed() and %llu regexec() calls\n", rp.nmatches,
+           calls, regexecs);
+}
 
-    while (true) {
-L_chk_sigchld:
-        if (g.SIGCHLDed) {
-            /*
-             * NOTE:
-             *  - WCONTINUED does not work on macOS (10.12.5)
-             *  - On macOS, SIGCHLD can be generated when
-             *     1. child process has terminated/exited
-             *     2. the currently *running* child process is stopped (e.g. by `kill -STOP')
-             *  - On Linux, SIGCHLD can be generated when
-             *     1. child process has terminated/exited
-             *     2. the currently *running* child process is stopped (e.g. by `kill -STOP')
-             *     3. the currently *stopped* child process is continued (e.g. by `kill -CONT')
-             *  - waitpid(WCONTINUED) works on Linux but not on macOS.
-             */
-            wait_return = waitpid(-1, &status, WUNTRACED | WCONTINUED);
-            if (wait_return < 0) {
-                fatal_sys("received SIGCHLD but waitpid() failed");
-            }
-            g.SIGCHLDed = false;
-
-            if (WIFEXITED(status) ) {
-                exit_code = WEXITSTATUS(status);
-                goto L_done;
-            } else if (WIFSIGNALED(status) ) {
-                exit_code = status + 128;
-                goto L_done;
-            } else if (WIFSTOPPED(status) ) {
-                /* Do nothing. Just wait for the child to be continued and wait
-                 * for the next SIGCHLD. */
-            } else if (WIFCONTINUED(status) ) {
-                /* */
-            } else {
-                /* This should not happen. */
-                goto L_done;
-            }
+void
+replay_run(char *path)
+{
+    unsigned long long nout = 0, nmatched = 0;
+    int64_t t_match = 0, t0;
+    struct replay_session *rs;
+    struct stat st;
+    char *data, *p, *end;
+    size_t len, n;
+    ssize_t nread;
+    unsigned id;
+    int fd, type;
+
+    if ((fd = open(path, O_RDONLY) ) < 0 || fstat(fd, &st) < 0) {
+        fatal_sys("open: %s", path);
+    }
+    /* all of it in memory first, so only the matching is timed */
+    if ((data = malloc(st.st_size + 1) ) == NULL) {
+        fatal_sys("malloc");
+    }
+    for (n = 0; n < st.st_size; n += nread) {
+        if ((nread = read(fd, data + n, st.st_size - n) ) < 0 && errno == EINTR) {
+            nread = 0;
+        } else if (nread < 0) {
+            fatal_sys("read: %s", path);
+        } else if (nread == 0) {
+            break;
+        }
+    }
+    end = data + n;
+    if (n < 16 || memcmp(data, REC_MAGIC, 8) != 0) {
+        fatal(ERROR_GENERAL, "%s: not a --record file", path);
+    }
+    rp.wall0 = rec_get(data + 8, 8);
+
+    for (p = data + 16; p + REC_HDRSIZE <= end; p += REC_HDRSIZE + len) {
+        rp.t = rec_get(p, 7);
+        type = p[7];
+        len = rec_get(p + 8, 4);
+        id = rec_get(p + 12, 4);
+        if (len > end - p - REC_HDRSIZE) {
+            /* passh was killed while writing it */
+            fprintf(stderr, "!! %s: truncated\r\n", path);
+            break;
+        }
+        if (type == REC_START) {
+            replay_start(id, p + REC_HDRSIZE, len);
+            continue;
+        }
+        if (id >= rp.nsessions || rp.sessions[id].s == NULL) {
+            fatal(ERROR_GENERAL, "%s: bad recording", path);
+        }
+        rs = &rp.sessions[id];
+
+        switch (type) {
+            case REC_OUTPUT:
+                nout += len;
+                cast_put(rs, type, p + REC_HDRSIZE, len);
+                if (rs->s->now_interactive || rs->s->given_up) {
+                    break;
+                }
+                if (g.opt.timeout != 0 && rp.t >= rs->deadline) {
+                    replay_note(rs->s, -1,
+                                g.opt.fatal_no_prompt && rs->s->passwords_seen == 0);
+                    rs->s->given_up = true;
+                    break;
+                }
+                /* session_match() stops once the pty is closed */
+                rs->s->fd_ptym = fd;
+                t0 = now_ns();
+                session_match(rs->s, p + REC_HDRSIZE, len);
+                t_match += now_ns() - t0;
+                nmatched += len;
+                break;
+            case REC_INPUT:
+                rs->s->now_interactive = true;
+                cast_put(rs, type, p + REC_HDRSIZE, len);
+                break;
+            case REC_SENT:
+                cast_put(rs, type, p + REC_HDRSIZE, len);
+                break;
         }
+    }
 
-        if (g.opt.timeout != 0 && g.opt.fatal_no_prompt && passwords_seen == 0
-            && labs(time(NULL) - last_time) > g.opt.timeout) {
-            fatal(ERROR_TIMEOUT, "timeout waiting for password prompt");
+    for (id = 0; id < rp.nsessions; ++id) {
+        if (rp.sessions[id].cast != NULL && fclose(rp.sessions[id].cast) != 0) {
+            fatal_sys("write: %s", g.opt.asciicast);
         }
+    }
+    replay_report(nout, nmatched, t_match);
+    exit(0);
+}
+
+/*
+ * libpassh, see libpassh.h. The sessions are run as in fleet mode, with the
+ * output and the events going to the callbacks. Every entry point sets
+ * g.lib.jmp so that fatal() fails the call rather than exiting.
+ */
+const char *
+passh_error(void)
+{
+    return g.lib.error;
+}
 
-        if (g.received_winch && g.stdin_is_tty) {
-            struct winsize ttysize;
-            static int ourtty = -1;
+int
+passh_init(char **options, const struct passh_callbacks *cb)
+{
+    jmp_buf jb;
+    char **argv;
+    int i, argc;
 
-            g.received_winch = false;
+    if (g.lib.on) {
+        snprintf(g.lib.error, sizeof(g.lib.error), "already initialized");
+        return -1;
+    }
+    g.lib.on = true;
+    g.lib.pid = getpid();
+    if (cb != NULL) {
+        g.lib.cb = *cb;
+    }
+    if (setjmp(jb) != 0) {
+        g.lib.jmp = NULL;
+        return -1;
+    }
+    g.lib.jmp = &jb;
 
-            if (ourtty < 0) {
-#if 0
-                ourtty = open("/dev/tty", 0);
-#else
-                ourtty = STDIN_FILENO;
-#endif
-            }
-            if (ioctl(ourtty, TIOCGWINSZ, &ttysize) == 0) {
-                ioctl(g.fd_ptym, TIOCSWINSZ, &ttysize);
-            }
+    /* getargs() keeps pointers into them */
+    for (argc = 0; options != NULL && options[argc] != NULL; ++argc)
+        ;
+    if ((argv = calloc(argc + 2, sizeof(char *) ) ) == NULL) {
+        fatal_sys("calloc");
+    }
+    argv[0] = MY_NAME;
+    for (i = 0; i < argc; ++i) {
+        if ((argv[i + 1] = strdup(options[i]) ) == NULL) {
+            fatal_sys("strdup");
         }
+    }
 
-        /* Keep sending EOF until the child exits
-         *  - See http://lists.gnu.org/archive/html/help-bash/2016-11/msg00002.html
-         *    (EOF ('\004') was lost if it's sent to bash too quickly)
-         *  - We cannot simply close(fd_ptym) or the child will get SIGHUP. */
-        while (stdin_eof) {
-            struct termios term;
-            char eof_char;
-            static struct timeval last;
-            struct timeval now;
-            double diff;
-
-            if (last.tv_sec == 0) {
-                gettimeofday(&last, NULL);
-                break;
-            }
+    startup();
+    getargs(argc + 1, argv);
+    g.fleet = true;
+    if (g.opt.supervise) {
+        srandom(getpid() ^ time(NULL) );
+    }
 
-            gettimeofday(&now, NULL);
-            diff = now.tv_sec + now.tv_usec / 1e6 - (last.tv_sec + last.tv_usec / 1e6);
-            if (diff > -0.05 && diff < 0.05) {
-                break;
-            }
-            last = now;
+    ev_init();
+    sig_init();
+    sig_watch(SIGCHLD);
 
-            if (tcgetattr(g.fd_ptym, &term) < 0) {
-                goto L_done;
-            }
-            eof_char = term.c_cc[VEOF];
-            if (write(g.fd_ptym, &eof_char, 1) < 0) {
-                goto L_done;
-            }
-            write(fd_to_pty, &eof_char, 1);
+    g.lib.jmp = NULL;
+    return 0;
+}
 
-            break;
+passh_session *
+passh_start(const char *label, char **argv, const char *password, void *arg)
+{
+    jmp_buf jb;
+    struct session *volatile s = NULL;
+    char **command, *copy;
+    int i, n;
+
+    if (setjmp(jb) != 0) {
+        g.lib.jmp = NULL;
+        if (s != NULL && s->state == SESS_PENDING) {
+            passh_free((passh_session *) s);
         }
+        return NULL;
+    }
+    g.lib.jmp = &jb;
 
-        FD_ZERO(&readfds);
-        if (g.stdin_is_tty && !stdin_eof) {
-            FD_SET(STDIN_FILENO, &readfds);
+    for (n = 0; argv[n] != NULL; ++n)
+        ;
+    if (n == 0) {
+        fatal(ERROR_USAGE, "Error: no command specified");
+    }
+    if ((command = calloc(n + 1, sizeof(char *) ) ) == NULL) {
+        fatal_sys("calloc");
+    }
+    for (i = 0; i < n; ++i) {
+        if ((command[i] = strdup(argv[i]) ) == NULL) {
+            fatal_sys("strdup");
         }
-        FD_SET(g.fd_ptym, &readfds);
+    }
+    if ((copy = strdup(label != NULL ? label : argv[0]) ) == NULL) {
+        fatal_sys("strdup");
+    }
+    s = session_new(copy, command);
+    s->arg = arg;
+    if (password != NULL && (s->password = strdup(password) ) == NULL) {
+        fatal_sys("strdup");
+    }
 
-        select_timeout.tv_sec = 1;
-        select_timeout.tv_usec = 100 * 1000;
+    ++g.nstarted;
+    session_start(s);
 
-        r = select(g.fd_ptym + 1, &readfds, NULL, NULL, &select_timeout);
-        if (r == 0) {
-            /* timeout */
-            continue;
-        } else if (r < 0) {
-            if (errno == EINTR) {
-                continue;
-            } else {
-                fatal_sys("select error");
-            }
-        }
+    g.lib.jmp = NULL;
+    return (passh_session *) s;
+}
 
-        /*
-         * copy data from ptym to stdout
-         */
-        if (FD_ISSET(g.fd_ptym, &readfds) ) {
-            while (true) {
-                nread = read_if_ready(g.fd_ptym, cache + ncache,
-                    2 * BUFFSIZE - (cache - buf2));
-                if (nread <= 0) {
-                    /* child exited? */
-                    goto L_chk_sigchld;
-                }
+int
+passh_fd(void)
+{
+#if defined(EV_EPOLL)
+    return ev.epfd;
+#else
+    return -1;
+#endif
+}
 
-                write2(STDOUT_FILENO, fd_from_pty, cache + ncache, nread);
+int
+passh_timeout(void)
+{
+    int i;
 
-                if (! given_up && g.opt.timeout != 0
-                    && labs(time(NULL) - last_time) >= g.opt.timeout) {
-                    given_up = true;
-                }
+    for (i = 0; i < g.nstarted; ++i) {
+        if (g.sessions[i]->unread && g.sessions[i]->state == SESS_RUNNING
+            && ! g.out_paused) {
+            return 0;
+        }
+    }
+    return timer_timeout();
+}
 
-                /* regexec() does not like NULLs */
-                if (! given_up) {
-                    for (i = 0; i < nread; ++i) {
-                        if (cache[ncache + i] == 0) {
-                            cache[ncache + i] = 0xff;
-                        }
-                    }
-                }
-                ncache += nread;
-                /* make it NULL-terminated so regexec() would be happy */
-                cache[ncache] = 0;
-
-                /* match password prompt and send the password */
-                if (! g.now_interactive && ! given_up) {
-                    if (g.opt.auto_yesno && passwords_seen == 0
-                        && regexec(&g.opt.re_yesno, cache, 1, re_match, 0) == 0)
-                    {
-                        /*
-                         * (yes/no)?
-                         */
-                        char *yes = "yes\r";
-
-                        write2(g.fd_ptym, fd_to_pty, yes, strlen(yes) );
-
-                        ncache -= re_match[0].rm_eo;
-                        cache += re_match[0].rm_eo;
-                    } else if (regexec(&g.opt.re_prompt, cache, 1, re_match, 0) == 0) {
-                        /*
-                         * Password:
-                         */
-
-                        ++passwords_seen;
-
-                        last_time = time(NULL);
-
-                        if (g.opt.fatal_more_tries) {
-                            if (g.opt.tries != 0 && passwords_seen > g.opt.tries) {
-                                fatal(ERROR_MAX_TRIES, "still prompted for passwords after %d tries", g.opt.tries);
-                            }
-                        } else if (g.opt.tries != 0 && passwords_seen >= g.opt.tries) {
-                            given_up = true;
-                        }
-
-                        write(g.fd_ptym, g.opt.password, strlen(g.opt.password));
-                        write(g.fd_ptym, "\r", 1);
-
-                        write(fd_to_pty, "********\r", strlen("********\r") );
-
-                        ncache -= re_match[0].rm_eo;
-                        cache += re_match[0].rm_eo;
-                    }
-                } else {
-                    cache = buf2;
-                    ncache = 0;
-                }
+int
+passh_step(int timeout)
+{
+    jmp_buf jb;
 
-                if (cache + ncache >= buf2 + 2 * BUFFSIZE) {
-                    if (ncache > BUFFSIZE) {
-                        cache += ncache - BUFFSIZE;
-                        ncache = BUFFSIZE;
-                    }
-                    memmove(buf2, cache, ncache);
-                    cache = buf2;
-                }
-            }
-        }
-        /*
-         * copy data from stdin to ptym
-         */
-        if (!stdin_eof && FD_ISSET(STDIN_FILENO, &readfds) ) {
-            if ((nread = read(STDIN_FILENO, buf1, BUFFSIZE)) < 0)
-                fatal_sys("read error from stdin");
-            else if (nread == 0) {
-                /* EOF on stdin means we're done */
-                stdin_eof = true;
-            } else {
-                g.now_interactive = true;
-                write2(g.fd_ptym, fd_to_pty, buf1, nread);
-            }
-        }
+    if (setjmp(jb) != 0) {
+        g.lib.jmp = NULL;
+        return -1;
+    }
+    g.lib.jmp = &jb;
+
+    if (g.nrunning > 0 || g.nrestarting > 0) {
+        loop_once(timeout);
     }
 
-L_done:
-    /* the child has exited but there may be still some data for us
-     * to read */
-    while ((nread = read_if_ready(g.fd_ptym, buf2, BUFFSIZE) ) > 0) {
-        write2(STDOUT_FILENO, fd_from_pty, buf2, nread);
+    g.lib.jmp = NULL;
+    return g.nrunning + g.nrestarting;
+}
+
+int
+passh_exit_code(passh_session *ps)
+{
+    struct session *s = (struct session *) ps;
+
+    if (s->state != SESS_DONE || s->t_restart.index >= 0) {
+        return -1;
     }
+    return s->exit_code < 0 ? ERROR_GENERAL : s->exit_code;
+}
 
-    if (fd_to_pty >= 0) {
-        close(fd_to_pty);
+void
+passh_free(passh_session *ps)
+{
+    struct session *s = (struct session *) ps;
+    int i;
+
+    if (s->state == SESS_RUNNING) {
+        kill(s->pid, SIGKILL);
+        while (waitpid(s->pid, NULL, 0) < 0 && errno == EINTR)
+            ;
+        session_done(s, SIGKILL + 128);
     }
-    if (fd_from_pty >= 0) {
-        close(fd_from_pty);
+    pid_del(s);
+    if (s->state == SESS_DONE && s->t_restart.index >= 0) {
+        timer_cancel(&s->t_restart);
+        --g.nrestarting;
+    }
+    if (s->ready && g.opt.ready) {
+        --g.nready;
     }
 
-    if (exit_code < 0) {
-        exit(ERROR_GENERAL);
-    } else {
-        exit(exit_code);
+    for (i = 0; i < g.nsessions && g.sessions[i] != s; ++i)
+        ;
+    memmove(&g.sessions[i], &g.sessions[i + 1],
+            (g.nsessions - i - 1) * sizeof(struct session *) );
+    --g.nsessions;
+    --g.nstarted;
+
+    for (i = 0; s->command[i] != NULL; ++i) {
+        free(s->command[i]);
+    }
+    free(s->command);
+    free(s->label);
+    free(s->tail);
+    free(s->mstate.nfa);
+    if (s->password != g.opt.password) {
+        free(s->password);
     }
+    free(s);
 }
 
+#if !defined(PASSH_LIBRARY)
 int
 main(int argc, char *argv[])
 {
-    char slave_name[32];
-    pid_t pid;
-    struct termios orig_termios;
-    struct winsize size;
-
     startup();
 
     getargs(argc, argv);
 
-    g.stdin_is_tty = isatty(STDIN_FILENO);
+    if (g.opt.pty_server != NULL) {
+        pty_server(g.opt.pty_server);
+    }
+    if (g.opt.agent != NULL) {
+        agent_run(g.opt.agent);
+    }
+    if (g.opt.replay != NULL) {
+        replay_run(g.opt.replay);
+    }
+
+    sessions_init();
+    if (g.opt.reuse_dir != NULL) {
+        reuse_init();
+    }
+    if (g.opt.supervise) {
+        /* so that passh processes restarting together don't stay together */
+        srandom(getpid() ^ time(NULL) );
+    }
 
-    sig_handle(SIGCHLD, sig_child);
+    /* Interactive only with a single session. */
+    g.stdin_is_tty = ! g.fleet && isatty(STDIN_FILENO);
 
-    if (g.stdin_is_tty) {
-        if (tcgetattr(STDIN_FILENO, &orig_termios) < 0)
-            fatal_sys("tcgetattr error on stdin");
-        if (ioctl(STDIN_FILENO, TIOCGWINSZ, (char *) &size) < 0)
-            fatal_sys("TIOCGWINSZ error");
+    ev_init();
 
-        pid = pty_fork(&g.fd_ptym, slave_name, sizeof(slave_name),
-            &orig_termios, &size);
+    sig_init();
+    sig_watch(SIGCHLD);
 
-    } else {
-        pid = pty_fork(&g.fd_ptym, slave_name, sizeof(slave_name),
-            NULL, NULL);
-    }
+    if (g.opt.stream_stdin && ! g.stdin_is_tty) {
+        struct stat st;
 
-    if (pid < 0) {
-        fatal_sys("fork error");
-    } else if (pid == 0) {
-        /*
-         * child
-         */
-        if (g.opt.nohup_child) {
-            sig_handle(SIGHUP, SIG_IGN);
+        if (fstat(STDIN_FILENO, &st) < 0) {
+            fatal_sys("fstat: stdin");
+        }
+        g.in.pollable = S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode);
+        if ((g.in.buf = malloc(RELAY_BUFFSIZE) ) == NULL) {
+            fatal_sys("malloc");
+        }
+        /* a child not reading its stdin must not kill us */
+        g.sigpipe_ignored = true;
+    }
+    /* nor a reader of the events or a --control client going away */
+    if (g.opt.events_fd >= 0 || g.opt.control != NULL) {
+        g.sigpipe_ignored = true;
+    }
+    if (g.sigpipe_ignored) {
+        sig_handle(SIGPIPE, SIG_IGN);
+    }
+    if (g.opt.events_fd >= 0) {
+        event_open(g.opt.events_fd);
+    }
+    /* before the first session_start(), for its REC_START */
+    if (g.opt.record != NULL) {
+        rec_open(g.opt.record);
+    }
+    g.pid = getpid();
+    if (g.opt.control != NULL) {
+        ctl_open(g.opt.control);
+    }
+    if (g.opt.stats || g.opt.stats_file != NULL) {
+        if (atexit(stats_atexit) < 0) {
+            fatal_sys("atexit error");
         }
-        if (execvp(g.opt.command[0], g.opt.command) < 0)
-            fatal_sys("can't execute: %s", g.opt.command[0]);
+    }
+
+    if (! g.fleet) {
+        session_start(g.sessions[g.nstarted++]);
     }
 
     /*
@@ -1050,12 +7940,13 @@ main(int argc, char *argv[])
         if (atexit(tty_atexit) < 0)
             fatal_sys("atexit error");
 
-        sig_handle(SIGWINCH, sig_winch);
+        sig_watch(SIGWINCH);
     }
 
     big_loop();
 
     return 0;
 }
+#endif
 
 /* vi:set ts=8 sw=4 sta et: */